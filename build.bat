@@ -5,6 +5,12 @@ set common_compiler_flags=-Od -fp:fast -nologo -MD -Oi -Gm- -GR- -EHa- -W4 -WX -
 IF NOT EXIST bin mkdir bin
 pushd bin
 
-cl %common_compiler_flags% ..\src\chip8.cpp /link -incremental:no -opt:ref ..\lib\raylib.lib user32.lib gdi32.lib winmm.lib shell32.lib
+cl %common_compiler_flags% -c ..\src\chip8_core.cpp ..\src\chip8_vec_env.cpp
+lib -nologo chip8_core.obj chip8_vec_env.obj /OUT:libchip8.lib
+cl %common_compiler_flags% ..\src\chip8.cpp /link -incremental:no -opt:ref libchip8.lib ..\lib\raylib.lib user32.lib gdi32.lib winmm.lib shell32.lib
+cl %common_compiler_flags% ..\src\chip8_aot.cpp /Fe:chip8-aot.exe /link -incremental:no -opt:ref
+cl %common_compiler_flags% ..\src\chip8_batch.cpp /Fe:chip8-batch.exe /link -incremental:no -opt:ref libchip8.lib
+cl %common_compiler_flags% ..\src\chip8_bench.cpp /Fe:chip8-bench.exe /link -incremental:no -opt:ref libchip8.lib
+cl %common_compiler_flags% ..\tests\vec_env_test.cpp /Fe:vec_env_test.exe /link -incremental:no -opt:ref libchip8.lib
 
 popd
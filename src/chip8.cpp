@@ -1,24 +1,36 @@
+/*
+raylib frontend: window, keyboard and audio around the libchip8 core.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "../include/raylib.h"
-#include "types.h"
+#include "chip8_core.h"
 
-#define SCREEN_WIDTH            (64)
-#define SCREEN_HEIGHT           (32)
-#define SCREEN_SIZE             (SCREEN_WIDTH*SCREEN_HEIGHT)
-#define SCALE                   (40)    /* Pixel scale */
-#define WINDOW_WIDTH            (SCREEN_WIDTH*SCALE)
-#define WINDOW_HEIGHT           (SCREEN_HEIGHT*SCALE)
-#define FPS                     (120)
+#define SCALE                   (40)    /* Pixel scale, in low resolution */
+#define WINDOW_WIDTH            (LORES_WIDTH*SCALE)
+#define WINDOW_HEIGHT           (LORES_HEIGHT*SCALE)
+#define FPS                     (60)
+#define DEFAULT_CPU_HZ          (600)   /* Instructions per second */
+#define UNLIMITED_BATCH         (1000)  /* Instructions between clock checks at unlimited speed */
+#define UNLIMITED_FRAME_SHARE   (0.75)  /* Part of the frame spent emulating at unlimited speed */
 
 #define USAGE_ERROR             1
-#define UNKNOWN_OPCODE          2
-#define ROM_DOES_NOT_EXISTS     3
 
-#define MAX_MEMORY_SIZE         (4096)  /* 4 KB */
-#define START_MEMORY            (0x200) /* First 512 are reserved */
+#define SNAPSHOT_SLOTS          4       /* On F1 to F4 */
+
+#define REWIND_KEY              KEY_BACKSPACE
+#define REWIND_SECONDS          60
+#define REWIND_BUFFER_SIZE      (512 * 1024) /* About 30 bytes a frame for most games */
+
+#define MAX_RUN_AHEAD           8       /* Frames */
+#define TURBO_KEY               KEY_TAB
+#define DEFAULT_TURBO_FRAMES    8       /* Frames run per frame shown in turbo */
+#define OVERLAY_KEY             KEY_F12
+#define OVERLAY_SMOOTHING       (0.05)  /* Weight of the last frame in the averages shown */
+#define MAX_PATH_LENGTH         1024
 
 #define MAX_SAMPLES             512
 #define MAX_SAMPLES_PER_UPDATE  4096
@@ -27,28 +39,6 @@
 #define NUMBER_OF_CHANNELS      1
 
 
-// Each font is made of 5 8-bit values (1 byte for each row), ranging from 0 to F.
-#define FONT_SIZE_BYTES         5
-#define FONTS_MEMORY_SIZE       (FONT_SIZE_BYTES * 16)
-u8 fonts[FONTS_MEMORY_SIZE] = {
-    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80, // F
-};
-
 /*
 CHIP-8 keypad:
 +---+---+---+---+
@@ -61,7 +51,6 @@ CHIP-8 keypad:
 | A | 0 | B | F |
 +---+---+---+---+
 */
-#define KEY_NUMBER 16
 u8 chip8_keys[KEY_NUMBER] = {
     0x1, 0x2, 0x3, 0xC,
     0x4, 0x5, 0x6, 0xD,
@@ -77,400 +66,407 @@ int input_keys[KEY_NUMBER] = {
 };
 
 
-struct Chip8_state {
-    u8 V[16]; // 16 8-bit registers, from V0 to VF.
-
-    u16 I; // Address register.
-    u16 stack[16];
-
-    u8 sp; // Stack pointer.
-    u16 pc; // Program counter.
-
-    u8 delay_timer; // Delay timer.
-    u8 sound_timer; // Sound timer.
-
-    u8 memory[MAX_MEMORY_SIZE];
-
-    u8 screen[SCREEN_SIZE];
+// What the raylib callbacks need.
+struct Frontend {
+    AudioStream stream;
+    Texture2D display;
+    Color pixels[SCREEN_SIZE];
 };
 
-static int get_key_pressed()
+static u16 read_keypad()
 {
+    u16 keys = 0;
     for (int i = 0; i < KEY_NUMBER; i++) {
         if (IsKeyDown(input_keys[i])) {
-            return chip8_keys[i];
+            keys |= (u16)(1 << chip8_keys[i]);
         }
     }
 
-    return -1;
+    return keys;
 }
 
-static void clear_screen(Chip8_state *state)
+static void set_sound(void *user_data, int on)
 {
-    memset(state->screen, 0, sizeof(state->screen));
+    Frontend *frontend = (Frontend *)user_data;
+    if (on) {
+        ResumeAudioStream(frontend->stream);
+    } else {
+        PauseAudioStream(frontend->stream);
+    }
 }
 
-
-static void emulate(Chip8_state *state)
+// Converts the rows that changed and uploads the texture. A 64x32 screen takes its
+// top-left corner.
+static void draw_screen(void *user_data, Chip8_state *state)
 {
-    u16 opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
-    state->pc += 2;
-
-    // printf("Simulating opcode: %04x\n", opcode);
-
-    
-    switch (opcode & 0xF000) {
-
-        case 0x1000: { // 1nnn: Jump to location nnn.
-            state->pc = opcode & 0xFFF;
-        } break;
-
-        case 0x2000: { // 2nnn: Call subroutine at nnn.
-            state->stack[state->sp++] = state->pc;
-            state->pc = opcode & 0xFFF;
-        } break;
-
-        case 0x3000: { // 3xkk: Skip next instruction if Vx = kk.
-            u8 vx = state->V[(opcode & 0xF00) >> 8];
-            u8 kk = opcode & 0xFF;
-            if (vx == kk) {
-                state->pc += 2;
-            }
-        } break;
+    Frontend *frontend = (Frontend *)user_data;
+    for (int i = 0; i < get_screen_height(state); i++) {
+        if (!(state->dirty_rows & ((u64)1 << i))) {
+            continue;
+        }
 
-        case 0x4000: { // 4xkk: Skip next instruction if Vx != kk.
-            u8 vx = state->V[(opcode & 0xF00) >> 8];
-            u8 kk = opcode & 0xFF;
-            if (vx != kk) {
-                state->pc += 2;
-            }
-        } break;
+        for (int j = 0; j < get_screen_width(state); j++) {
+            frontend->pixels[(i * SCREEN_WIDTH) + j] = get_pixel(state, j, i) ? WHITE : BLACK;
+        }
+    }
 
-        case 0x5000: { // 5xy0: Skip next instruction if Vx = Vy.
-            u8 vx = state->V[(opcode & 0xF00) >> 8];
-            u8 vy = state->V[(opcode & 0xF0) >> 4];
-            if (vx == vy) {
-                state->pc += 2;
-            }
-        } break;
+    UpdateTexture(frontend->display, frontend->pixels);
+}
 
-        case 0x6000: { // 6xkk: Set Vx = kk.
-            state->V[(opcode & 0xF00) >> 8] = (opcode & 0xFF);
-        } break;
+static float frequency = 440.0f;
+// Index for audio rendering
+static float sine_idx = 0.0f;
 
-        case 0x7000: { // 7xkk: Set Vx = Vx + kk.
-            state->V[(opcode & 0xF00) >> 8] += (opcode & 0xFF);
-        } break;
+// Audio input processing callback
+static void AudioInputCallback(void *buffer, unsigned int frames)
+{
+    float incr = frequency/SAMPLE_RATE;
+    short *d = (short *)buffer;
 
-        case 0x8000: {
-            u8 x = (opcode & 0xF00) >> 8;
-            u8 y = (opcode & 0xF0) >> 4;
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        d[i] = (short)(32000.0f*sinf(2*PI*sine_idx));
+        sine_idx += incr;
+        if (sine_idx > 1.0f) {
+            sine_idx -= 1.0f;
+        }
+    }
+}
 
-            switch (opcode & 0xF) {
-                case 0x0: { // 8xy0: Set Vx = Vy.
-                    state->V[x] = state->V[y];
-                } break;
+static Chip8_state chip8_state = {};
+static Frontend frontend = {};
+static Chip8_rewind chip8_rewind = {};
+static Chip8_movie movie = {};
+
+// Frame time overlay, in milliseconds averaged over the last frames.
+struct Overlay {
+    int shown;
+    double emulation; // Running the frame itself.
+    double run_ahead; // Running the frames ahead, and saving and restoring the machine.
+};
 
-                case 0x1: { // 8xy1: Set Vx = Vx OR Vy.
-                    state->V[x] |= state->V[y];
-                } break;
+static Overlay overlay = {};
 
-                case 0x2: { // 8xy2: Set Vx = Vx AND Vy.
-                    state->V[x] &= state->V[y];
-                } break;
+static void average_time(double *average, double milliseconds)
+{
+    *average += (milliseconds - *average) * OVERLAY_SMOOTHING;
+}
 
-                case 0x3: { // 8xy3: Set Vx = Vx XOR Vy.
-                    state->V[x] ^= state->V[y];
-                } break;
+static void draw_overlay(int run_ahead_frames, int turbo_frames)
+{
+    char text[256];
+    int length = snprintf(text, sizeof(text), "frame %.2f ms  emulation %.3f ms  run-ahead %.3f ms (%d frames)",
+                          GetFrameTime() * 1000.0, overlay.emulation, overlay.run_ahead, run_ahead_frames);
+    if (turbo_frames > 0) {
+        snprintf(text + length, sizeof(text) - length, "  turbo x%d", turbo_frames);
+    }
 
-                case 0x4: { // 8xy4: Set Vx = Vx + Vy, set VF = carry.
-                    state->V[x] += state->V[y];
+    DrawRectangle(0, 0, WINDOW_WIDTH, 30, Fade(BLACK, 0.6f));
+    DrawText(text, 8, 6, 20, GREEN);
+}
 
-                    state->V[0xF] = (state->V[x] < state->V[y]); // Carry
-                } break;
+// Loaded from and saved to <rom>.<slot number>.c8s. An empty slot is all zeros.
+static Chip8_snapshot snapshots[SNAPSHOT_SLOTS];
 
-                case 0x5: { // 8xy5: Set Vx = Vx - Vy, set VF = NOT borrow.
-                    state->V[0xF] = (state->V[x] >= state->V[y]);
+static void get_snapshot_path(char *path, const char *filename_rom, int slot)
+{
+    snprintf(path, MAX_PATH_LENGTH, "%s.%d.c8s", filename_rom, slot + 1);
+}
 
-                    state->V[x] -= state->V[y];
-                } break;
+// Shift+F1 to F4 save the machine into a slot, F1 to F4 restore it.
+static void update_snapshots(Chip8_state *state, const char *filename_rom)
+{
+    for (int slot = 0; slot < SNAPSHOT_SLOTS; slot++) {
+        if (!IsKeyPressed(KEY_F1 + slot)) {
+            continue;
+        }
 
-                case 0x6: { // 8xy6: Set Vx = Vx SHR 1.
-                    state->V[0xF] = (state->V[x] & 1); // If least-significant bit is 1
-                    
-                    state->V[x] >>= 1;
-                } break;
+        char path[MAX_PATH_LENGTH];
+        get_snapshot_path(path, filename_rom, slot);
 
-                case 0x7: { // 8xy7: Set Vx = Vy - Vx, set VF = NOT borrow.
-                    state->V[0xF] = (state->V[y] >= state->V[x]);
+        if (IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT)) {
+            save_chip8(state, &snapshots[slot]);
+            if (write_snapshot(&snapshots[slot], path)) {
+                fprintf(stderr, "Can't write %s\n", path);
+            }
+        } else if (restore_chip8(state, &snapshots[slot]) == SNAPSHOT_MISMATCH) {
+            fprintf(stderr, "%s was saved with another ROM\n", path);
+        }
+    }
+}
 
-                    state->V[x] = state->V[y] - state->V[x];
-                } break;
+// No callbacks, for the frames that must not be heard or seen.
+static Chip8_io quiet_io = {};
+static Chip8_snapshot run_ahead_snapshot;
 
-                case 0xE: { // 8xyE: Set Vx = Vx SHL 1.
-                    state->V[0xF] = (state->V[x] >> 7); // If most-significant bit is 1
+/*
+Run-ahead: ends the frame just run without showing it, runs frames_ahead more frames with
+the same keys, shows the last of them and puts the machine back. The game then reacts to
+a key frames_ahead frames earlier than it would.
+*/
+static void end_frame_run_ahead(Chip8_state *state, u32 cycles_per_frame, int frames_ahead)
+{
+    Chip8_io *io = state->io;
+    state->io = &quiet_io;
 
-                    state->V[x] <<= 1;
-                } break;
+    end_chip8_frame(state);
+    set_sound(&frontend, get_sound_timer(state) > 0);
 
-            }
-        } break;
+    save_chip8(state, &run_ahead_snapshot);
+    for (int i = 0; i < frames_ahead; i++) {
+        run_chip8(state, cycles_per_frame);
+        end_chip8_frame(state);
+    }
 
-        case 0x9000: { // 9xy0: Skip next instruction if Vx != Vy.
-            u8 vx = state->V[(opcode & 0xF00) >> 8];
-            u8 vy = state->V[(opcode & 0xF0) >> 4];
-            if (vx != vy) {
-                state->pc += 2;
-            }
-        } break;
-
-        case 0xA000 : { // Annn: Set I = nnn.
-            state->I = opcode & 0xFFF;
-        } break;
-
-        case 0xB000: { // Bnnn: Jump to location nnn + V0.
-            state->pc = (opcode & 0xFFF) + state->V[0];
-        } break;
-
-        case 0xC000: { // Cxkk: Set Vx = random byte AND kk.
-            u8 random = rand() % 0xFF;
-            state->V[(opcode & 0xF00) >> 8] = random & (opcode & 0xFF);
-        } break;
-
-        case 0xD000: { // Dxyn: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
-            u8 sprite_width = 8;
-            u8 n = opcode & 0xF;
-            u8 vx = state->V[(opcode >> 8) & 0xF];
-            u8 vy = state->V[(opcode >> 4) & 0xF];
-
-            u8 collision = 0;
-
-            for (int row = 0; row < n; row++) {
-                u8 sprite_row = state->memory[state->I + row];; // Each bit is 1 pixel
-
-                for (int col = 0; col < sprite_width; col++) {
-                    int screen_index = ((vy + row) * SCREEN_WIDTH) + (vx + col);
-                    u8 bit_value = (sprite_row >> (7 - col)) & 1; // Set the corresponding bit to the screen byte
-                    
-                    if (state->screen[screen_index] == 1 && state->screen[screen_index] & bit_value) {
-                        collision = 1;
-                    }
-
-                    state->screen[screen_index] ^= bit_value;
-                }
-            }
+    state->dirty_rows = ~(u64)0;
+    draw_screen(&frontend, state);
 
-            state->V[0xF] = collision;
-        } break;
-        
-        case 0xE000: {
-            int key_pressed = get_key_pressed();
-            int vx = state->V[(opcode & 0xF00) >> 8];
-
-            switch (opcode & 0xFF) {
-                case 0x9E: { // Ex9E: Skip next instruction if key with the value of Vx is pressed.
-                    if (key_pressed == vx) {
-                        state->pc += 2;
-                    }
-                } break;
-
-                case 0xA1: { // ExA1: Skip next instruction if key with the value of Vx is not pressed.
-                    if (key_pressed != vx) {
-                        state->pc += 2;
-                    }
-                } break;
-            }
-        } break;
-        
-        case 0xF000: {
-            u8 x = (opcode & 0xF00) >> 8;
-            switch (opcode & 0xFF) {
-                case 0x07: { // Fx07: Set Vx = delay timer value.
-                    state->V[x] = state->delay_timer;
-                } break;
-
-                case 0x0A: { // Fx0A: Wait for a key press, store the value of the key in Vx.
-                    int key_pressed;
-                    while ((key_pressed = get_key_pressed()) == -1)
-                        ;
-
-                    state->V[x] = (u8)key_pressed;
-                } break;
-
-                case 0x15: { // Fx15: Set delay timer = Vx.
-                    state->delay_timer = state->V[x];
-                } break;
-
-                case 0x18: { // Fx18: Set sound timer = Vx.
-                    state->sound_timer = state->V[x];
-                } break;
-
-                case 0x1E: { // Fx1E: Set I = I + Vx.
-                    state->I += state->V[x];
-                } break;
-
-                case 0x29: { // Fx29: Set I to the memory address of the sprite data corresponding to the hexadecimal digit stored in register VX.
-                    state->I = (state->V[x] * FONT_SIZE_BYTES);
-                } break;
-
-                case 0x33: { // Fx33: Store BCD representation of Vx in memory locations I, I+1, and I+2.
-                             // Takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.
-                    u8 vx = state->V[x];
-                    state->memory[state->I] = vx / 100;
-                    vx = vx % 100;
-                    state->memory[state->I + 1] = vx / 10;
-                    vx = vx % 10;
-                    state->memory[state->I + 2] = vx;
-                } break;
-
-                case 0x55: { // Fx55: Store the values of registers V0 to VX inclusive in memory starting at address I.
-                    for (int i = 0; i <= x; i++) {
-                        state->memory[state->I + i] = state->V[i];
-                    }
-                } break;
-
-                case 0x65: { // Fx65: Fill registers V0 to VX inclusive with the values stored in memory starting at address I.
-                    for (int i = 0; i <= x; i++) {
-                        state->V[i] = state->memory[state->I + i];
-                    }
-                } break;
-            }
-        } break;
-        default: {
-            switch (opcode & 0xFF) {
-                case 0x00EE: { // 00EE: Return from a subroutine.
-                    state->pc = state->stack[--state->sp];
-                } break;
-
-                case 0x00E0: {
-                    clear_screen(state);
-                } break;
-
-                default: {
-                    fprintf(stderr, "Unknown opcode: %04x\n", opcode);
-
-                    exit(UNKNOWN_OPCODE);
-                } break;
-            }
-        } break;
-    }
+    // The real frame wasn't shown, so nothing is left to redraw.
+    restore_chip8(state, &run_ahead_snapshot);
+    state->screen_dirty = 0;
+    state->dirty_rows = 0;
 
+    state->io = io;
+}
 
-    if (state->delay_timer > 0) {
-        state->delay_timer--;
+static void save_movie(const char *filename_movie, Chip8_state *state)
+{
+    if (filename_movie && write_movie(&movie, state, filename_movie)) {
+        fprintf(stderr, "Can't write %s\n", filename_movie);
     }
+}
 
-    if (state->sound_timer > 0) {
-        state->sound_timer--;
+static void save_profile(const char *filename_profile, Chip8_state *state)
+{
+    if (filename_profile && write_profile(state, filename_profile)) {
+        fprintf(stderr, "Can't write %s (is the core built with CHIP8_PROFILE?)\n", filename_profile);
     }
 }
 
-static void init_chip8(Chip8_state *state, char *filename_rom)
+/*
+Runs the instructions of one frame: cycles_per_frame of them, or with cycles_per_frame
+as 0, as many as fit in the part of the frame not needed for rendering.
+*/
+static void run_frame(Chip8_state *state, u32 cycles_per_frame)
 {
-    printf("Loading %s...\n", filename_rom);
+    if (cycles_per_frame > 0) {
+        run_chip8(state, cycles_per_frame);
+        return;
+    }
 
-    clear_screen(state);
+    double deadline = GetTime() + UNLIMITED_FRAME_SHARE/FPS;
+    // A game waiting for the next frame has nothing left to run in this one.
+    do {
+        run_chip8(state, UNLIMITED_BATCH);
+    } while (!state->idle && GetTime() < deadline);
+}
 
-    memset(state->memory, 0, MAX_MEMORY_SIZE);
+/*
+Turbo: runs turbo_frames whole frames, silent and unseen, then shows the last of them.
+With the frame rate cap lifted as well, the game goes as fast as the emulation can.
+*/
+static void run_turbo(Chip8_state *state, u32 cycles_per_frame, int turbo_frames)
+{
+    Chip8_io *io = state->io;
+    state->io = &quiet_io;
 
-    // Load fonts into memory
-    for (int i = 0; i < FONTS_MEMORY_SIZE; i++) {
-        state->memory[i] = fonts[i];
+    for (int i = 0; i < turbo_frames && !state->error; i++) {
+        run_frame(state, cycles_per_frame);
+        end_chip8_frame(state);
     }
 
-    FILE *rom;
-    errno_t fopen_error = fopen_s(&rom, filename_rom, "rb");
-    if (fopen_error != 0) {
-        exit(1);
-    }
-    
-    while (!feof(rom)) {
-        fread(state->memory + START_MEMORY, 1, MAX_MEMORY_SIZE, rom);
-    }
+    state->dirty_rows = ~(u64)0;
+    draw_screen(&frontend, state);
+    state->dirty_rows = 0;
 
-    state->pc = START_MEMORY;
-    state->sp = 0;
+    state->io = io;
 }
 
-
-static float frequency = 440.0f;
-// Index for audio rendering
-static float sine_idx = 0.0f;
-
-// Audio input processing callback
-static void AudioInputCallback(void *buffer, unsigned int frames)
+static void usage(char *program)
 {
-    float incr = frequency/SAMPLE_RATE;
-    short *d = (short *)buffer;
+    fprintf(stderr,
+            "Usage: %s [--hz <instructions per second>|unlimited] [--run-ahead <frames>]\n"
+            "          [--turbo <frames>] [--seed <seed>] [--record <movie>] [--profile <file>] <game>\n", program);
 
-    for (unsigned int i = 0; i < frames; i++)
-    {
-        d[i] = (short)(32000.0f*sinf(2*PI*sine_idx));
-        sine_idx += incr;
-        if (sine_idx > 1.0f) {
-            sine_idx -= 1.0f;
-        }
-    }
+    exit(USAGE_ERROR);
 }
 
-static Chip8_state chip8_state = {};
-
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <game>\n", argv[0]);
+    char *filename_rom = 0;
+    u32 cycles_per_frame = DEFAULT_CPU_HZ / FPS;
+    int run_ahead_frames = 0;
+    int turbo_frames = DEFAULT_TURBO_FRAMES;
+    int turbo = 0;
+    u32 seed = 0;
+    char *filename_movie = 0;
+    char *filename_profile = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            char *hz = argv[++i];
+            if (strcmp(hz, "unlimited") == 0) {
+                cycles_per_frame = 0;
+            } else if (atoi(hz) > 0) {
+                cycles_per_frame = (atoi(hz) + FPS - 1) / FPS;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            run_ahead_frames = atoi(argv[++i]);
+            if (run_ahead_frames < 1 || run_ahead_frames > MAX_RUN_AHEAD) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+            turbo_frames = atoi(argv[++i]);
+            turbo = 1;
+            if (turbo_frames < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (u32)strtoul(argv[++i], 0, 0);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            filename_movie = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            filename_profile = argv[++i];
+        } else if (!filename_rom) {
+            filename_rom = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
 
-        exit(USAGE_ERROR);
+    // Frames ahead, and replays, must run as many instructions as the real frames.
+    if (!filename_rom || ((run_ahead_frames > 0 || filename_movie) && cycles_per_frame == 0)) {
+        usage(argv[0]);
     }
 
-    char *filename_rom = argv[1];
+    Chip8_io io = {};
+    io.user_data = &frontend;
+    io.set_sound = set_sound;
+    io.draw_screen = draw_screen;
+
+    printf("Loading %s...\n", filename_rom);
+
     Chip8_state *state = &chip8_state;
-    init_chip8(state, filename_rom);
-    
+    int error = init_chip8(state, filename_rom, &io);
+    if (error) {
+        exit(error);
+    }
+
+    seed_chip8(state, seed);
+    if (filename_movie) {
+        start_movie(&movie, state, seed, cycles_per_frame);
+    }
+
+    for (int slot = 0; slot < SNAPSHOT_SLOTS; slot++) {
+        char path[MAX_PATH_LENGTH];
+        get_snapshot_path(path, filename_rom, slot);
+        read_snapshot(&snapshots[slot], path);
+    }
 
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, filename_rom);
     InitAudioDevice();
 
-    SetTargetFPS(FPS);
+    SetTargetFPS(turbo ? 0 : FPS);
 
     SetAudioStreamBufferSizeDefault(MAX_SAMPLES_PER_UPDATE);
 
     // Init raw audio stream (sample rate: 44100, sample size: 16bit-short, channels: 1-mono)
-    AudioStream stream = LoadAudioStream(SAMPLE_RATE, SAMPLE_SIZE, NUMBER_OF_CHANNELS);
+    frontend.stream = LoadAudioStream(SAMPLE_RATE, SAMPLE_SIZE, NUMBER_OF_CHANNELS);
 
-    SetAudioStreamCallback(stream, AudioInputCallback);
+    SetAudioStreamCallback(frontend.stream, AudioInputCallback);
 
-    PlayAudioStream(stream);    // Start processing stream buffer (initialization of audio)
-    PauseAudioStream(stream);   //      but stop it immediately
+    PlayAudioStream(frontend.stream);    // Start processing stream buffer (initialization of audio)
+    PauseAudioStream(frontend.stream);   //      but stop it immediately
 
-    // Main loop
+    // The screen is presented as a SCREEN_WIDTH x SCREEN_HEIGHT texture, of which the part the
+    // current resolution uses is scaled up to the window.
+    Image display_image = GenImageColor(SCREEN_WIDTH, SCREEN_HEIGHT, BLACK);
+    frontend.display = LoadTextureFromImage(display_image);
+    UnloadImage(display_image);
+
+    init_rewind(&chip8_rewind, REWIND_SECONDS * FPS, REWIND_BUFFER_SIZE);
+    push_rewind(&chip8_rewind, state);
+
+    // Main loop: the CPU runs a batch of instructions per frame, and the screen is drawn once.
+    // Holding REWIND_KEY goes back a frame per frame instead.
+    // TURBO_KEY toggles turbo, which runs turbo_frames frames per frame drawn, uncapped and muted.
+    // A recording only goes forward: snapshots and rewind are off.
     while (!WindowShouldClose()) {
-        emulate(state);
+        state->keys = read_keypad();
+        if (filename_movie) {
+            record_movie(&movie, state);
+        } else {
+            update_snapshots(state, filename_rom);
+        }
+
+        if (IsKeyPressed(OVERLAY_KEY)) {
+            overlay.shown = !overlay.shown;
+        }
+
+        if (IsKeyPressed(TURBO_KEY)) {
+            turbo = !turbo;
+            SetTargetFPS(turbo ? 0 : FPS);
+            set_sound(&frontend, 0);
+        }
 
-        if (state->sound_timer > 0) {
-            ResumeAudioStream(stream);
+        if (!filename_movie && IsKeyDown(REWIND_KEY)) {
+            set_sound(&frontend, 0);
+            if (pop_rewind(&chip8_rewind, state)) {
+                draw_screen(&frontend, state);
+            }
+        } else if (turbo) {
+            // One rewind entry per frame drawn, so rewinding goes back turbo_frames at a time.
+            double start = GetTime();
+            run_turbo(state, cycles_per_frame, turbo_frames);
+            average_time(&overlay.emulation, (GetTime() - start) * 1000.0);
+
+            push_rewind(&chip8_rewind, state);
         } else {
-            PauseAudioStream(stream);
+            double start = GetTime();
+            run_frame(state, cycles_per_frame);
+            double end = GetTime();
+            average_time(&overlay.emulation, (end - start) * 1000.0);
+
+            if (run_ahead_frames > 0) {
+                end_frame_run_ahead(state, cycles_per_frame, run_ahead_frames);
+                average_time(&overlay.run_ahead, (GetTime() - end) * 1000.0);
+            } else {
+                end_chip8_frame(state);
+            }
+
+            push_rewind(&chip8_rewind, state);
+        }
+
+        if (state->error == UNKNOWN_OPCODE) {
+            u16 opcode = (u16)(state->memory[MEMORY_ADDRESS(state->pc)] << 8 | state->memory[MEMORY_ADDRESS(state->pc + 1)]);
+            fprintf(stderr, "Unknown opcode: %04x\n", opcode);
+
+            save_movie(filename_movie, state);
+            save_profile(filename_profile, state);
+            exit(UNKNOWN_OPCODE);
         }
 
         BeginDrawing();
-            for (int i = 0; i < SCREEN_HEIGHT; i++) {
-                for (int j = 0; j < SCREEN_WIDTH; j++) {
-                    int index = (i * SCREEN_WIDTH) + j;
-                    Color color = (state->screen[index] == 1) ? WHITE : BLACK;
-                    float x = (float)j*SCALE;
-                    float y = (float)i*SCALE;
-                    float width = SCALE;
-                    float height = SCALE;
-
-                    Rectangle pixel = { x, y, width, height };
-                    DrawRectangleRec(pixel, color);
-                }
+            Rectangle source = { 0, 0, (float)get_screen_width(state), (float)get_screen_height(state) };
+            Rectangle destination = { 0, 0, (float)WINDOW_WIDTH, (float)WINDOW_HEIGHT };
+            Vector2 origin = { 0, 0 };
+            DrawTexturePro(frontend.display, source, destination, origin, 0, WHITE);
+
+            if (overlay.shown) {
+                draw_overlay(run_ahead_frames, turbo ? turbo_frames : 0);
             }
         EndDrawing();
     }
 
-    UnloadAudioStream(stream);   // Close raw audio stream and delete buffers from RAM
+    save_movie(filename_movie, state);
+    save_profile(filename_profile, state);
+    free_movie(&movie);
+    free_rewind(&chip8_rewind);
+    free_chip8(state);
+    UnloadTexture(frontend.display);
+    UnloadAudioStream(frontend.stream);   // Close raw audio stream and delete buffers from RAM
     CloseAudioDevice();
     CloseWindow();
     
@@ -0,0 +1,454 @@
+/*
+Ahead-of-time compiler: translates the code reachable from 0x200 in a ROM into a C++
+source file that runs it directly against Chip8_state, with a label per instruction and
+gotos for the jumps, so there is no fetch or dispatch left for the compiled code.
+
+Usage: chip8-aot <rom> <output.cpp>
+
+The output is included by chip8_core.cpp when built with -DCHIP8_AOT=\"<output.cpp>\".
+Code that can't be known ahead of time falls back to emulate(): the targets of Bnnn and
+00EE go through a switch on the PC that interprets addresses which weren't compiled, and
+once the compiled code has been overwritten (Fx33/Fx55) everything is interpreted.
+
+A backward 1nnn over a body of idle instructions goes through run_idle_loop(), so idle
+loops are skipped to the end of the frame as in the other backends.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "types.h"
+#include "chip8_decode.h"
+
+#define USAGE_ERROR             1
+#define ROM_DOES_NOT_EXISTS     3
+
+#define MAX_MEMORY_SIZE         (4096)
+#define START_MEMORY            (0x200)
+
+// Indexed by Op_kind. The handler of each instruction is op_<name>.
+static const char *op_names[OP_COUNT] = {
+    "none",
+    "cls",
+    "ret",
+    "jp",
+    "call",
+    "se_vx_kk",
+    "sne_vx_kk",
+    "se_vx_vy",
+    "ld_vx_kk",
+    "add_vx_kk",
+    "ld_vx_vy",
+    "or",
+    "and",
+    "xor",
+    "add_vx_vy",
+    "sub",
+    "shr",
+    "subn",
+    "shl",
+    "sne_vx_vy",
+    "ld_i",
+    "jp_v0",
+    "rnd",
+    "drw",
+    "skp",
+    "sknp",
+    "ld_vx_dt",
+    "ld_vx_k",
+    "ld_dt_vx",
+    "ld_st_vx",
+    "add_i_vx",
+    "ld_f_vx",
+    "ld_b_vx",
+    "ld_i_vx",
+    "ld_vx_i",
+    "scd",
+    "scr",
+    "scl",
+    "exit",
+    "low",
+    "high",
+    "ld_hf_vx",
+    "ld_r_vx",
+    "ld_vx_r",
+    "nop",
+    "unknown",
+};
+
+static u8 memory[MAX_MEMORY_SIZE];
+static u16 rom_end; // One past the last byte of the ROM.
+
+static u8 reachable[MAX_MEMORY_SIZE]; // Addresses where an instruction starts.
+static u8 covered[MAX_MEMORY_SIZE]; // Bytes that belong to a reachable instruction.
+
+static u16 fetch(u16 address)
+{
+    return memory[address] << 8 | memory[address + 1];
+}
+
+static int is_compiled(u16 address)
+{
+    return address < MAX_MEMORY_SIZE && reachable[address];
+}
+
+// Whether the 1nnn at address may close an idle loop (see run_idle_loop() in chip8_core.cpp).
+static int may_close_idle_loop(u16 address, u16 target)
+{
+    if (target > address || address - target > 2 * IDLE_MAX_BODY) {
+        return 0;
+    }
+
+    for (u16 at = target; at < address; at += 2) {
+        Decoded_instruction inst;
+        decode_instruction(fetch(at), &inst);
+        if (!is_idle_op(inst.op)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Walks every path from 0x200, following the jumps whose target is known.
+static void find_reachable_code()
+{
+    static u16 pending[MAX_MEMORY_SIZE * 2];
+    int pending_count = 0;
+
+    pending[pending_count++] = START_MEMORY;
+
+    while (pending_count > 0) {
+        u16 address = pending[--pending_count];
+        if (address < START_MEMORY || address + 1 >= rom_end || reachable[address]) {
+            continue;
+        }
+
+        reachable[address] = 1;
+        covered[address] = 1;
+        covered[address + 1] = 1;
+
+        Decoded_instruction inst;
+        decode_instruction(fetch(address), &inst);
+
+        switch (inst.op) {
+            case OP_JP: {
+                pending[pending_count++] = inst.nnn;
+            } break;
+
+            case OP_CALL: {
+                pending[pending_count++] = inst.nnn;
+                pending[pending_count++] = address + 2;
+            } break;
+
+            case OP_SE_VX_KK:
+            case OP_SNE_VX_KK:
+            case OP_SE_VX_VY:
+            case OP_SNE_VX_VY:
+            case OP_SKP:
+            case OP_SKNP: {
+                pending[pending_count++] = address + 2;
+                pending[pending_count++] = address + 4;
+            } break;
+
+            // The target is only known at run time, or there is none.
+            case OP_RET:
+            case OP_JP_V0:
+            case OP_EXIT:
+            case OP_UNKNOWN: {
+            } break;
+
+            default: {
+                pending[pending_count++] = address + 2;
+            } break;
+        }
+    }
+}
+
+static void write_tables(FILE *out)
+{
+    fprintf(out, "// Ranges [start, end) of the memory holding compiled code.\n");
+    fprintf(out, "static const u16 aot_code_ranges[][2] = {\n");
+    int range_count = 0;
+    for (int address = 0; address < MAX_MEMORY_SIZE; address++) {
+        if (covered[address] && (address == 0 || !covered[address - 1])) {
+            int end = address;
+            while (end < MAX_MEMORY_SIZE && covered[end]) {
+                end++;
+            }
+            fprintf(out, "    { 0x%03x, 0x%03x },\n", address, end);
+            range_count++;
+        }
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "#define AOT_CODE_RANGE_COUNT %d\n\n", range_count);
+
+    fprintf(out, "// Contents of those ranges, one after the other.\n");
+    fprintf(out, "static const u8 aot_code[] = {");
+    int written = 0;
+    for (int address = 0; address < MAX_MEMORY_SIZE; address++) {
+        if (covered[address]) {
+            fprintf(out, "%s0x%02x,", (written % 16 == 0) ? "\n    " : " ", memory[address]);
+            written++;
+        }
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "// One bit per memory byte, set for compiled code.\n");
+    fprintf(out, "static const u32 aot_code_map[MAX_MEMORY_SIZE / 32] = {");
+    for (int word = 0; word < MAX_MEMORY_SIZE / 32; word++) {
+        u32 bits = 0;
+        for (int bit = 0; bit < 32; bit++) {
+            if (covered[word*32 + bit]) {
+                bits |= 1u << bit;
+            }
+        }
+        fprintf(out, "%s0x%08x,", (word % 8 == 0) ? "\n    " : " ", bits);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+static void write_helpers(FILE *out)
+{
+    fprintf(out,
+        "static int aot_code_intact(Chip8_state *state)\n"
+        "{\n"
+        "    const u8 *code = aot_code;\n"
+        "    for (int i = 0; i < AOT_CODE_RANGE_COUNT; i++) {\n"
+        "        int size = aot_code_ranges[i][1] - aot_code_ranges[i][0];\n"
+        "        if (memcmp(state->memory + aot_code_ranges[i][0], code, size) != 0) {\n"
+        "            return 0;\n"
+        "        }\n"
+        "        code += size;\n"
+        "    }\n"
+        "\n"
+        "    return 1;\n"
+        "}\n"
+        "\n"
+        "static int aot_writes_code(u16 address, int count)\n"
+        "{\n"
+        "    for (int i = 0; i < count; i++) {\n"
+        "        u16 byte = MEMORY_ADDRESS(address + i);\n"
+        "        if (aot_code_map[byte >> 5] & (1u << (byte & 31))) {\n"
+        "            return 1;\n"
+        "        }\n"
+        "    }\n"
+        "\n"
+        "    return 0;\n"
+        "}\n"
+        "\n"
+        "// Checks the budget, then counts the instruction at address and moves the PC past it.\n"
+        "#define AOT_STEP(address)                                       \\\n"
+        "    if (executed == count) { state->pc = address; return executed - skipped; } \\\n"
+        "    executed++;                                                 \\\n"
+        "    state->pc = address + 2\n"
+        "\n"
+        "#define AOT_EXEC(handler, op, x, y, n, kk, nnn)                 \\\n"
+        "    { Decoded_instruction inst = { op, x, y, n, kk, nnn }; handler(state, &inst); }\n"
+        "\n"
+        "// The compiled code was just overwritten: interpret the rest.\n"
+        "#define AOT_LEAVE()                                             \\\n"
+        "    { return executed - skipped + run_instructions(state, count - executed); }\n"
+        "\n"
+        "// Runs the loop the jump at address may close, skipping it when it is idle.\n"
+        "#define AOT_IDLE_LOOP(address)                                  \\\n"
+        "    if (executed < count) {                                     \\\n"
+        "        state->pc = address;                                    \\\n"
+        "        u32 ran = run_idle_loop(state, fetch_decoded(state), count - executed, &skipped); \\\n"
+        "        if (ran) { executed += ran; goto dispatch; }            \\\n"
+        "    }\n"
+        "\n");
+}
+
+static void write_label_goto(FILE *out, u16 target)
+{
+    if (is_compiled(target)) {
+        fprintf(out, "    goto L_%03x;\n", target);
+    } else {
+        fprintf(out, "    state->pc = 0x%03x;\n", target);
+        fprintf(out, "    goto dispatch;\n");
+    }
+}
+
+static void write_instruction(FILE *out, u16 address, int next_compiled)
+{
+    u16 opcode = fetch(address);
+    Decoded_instruction inst;
+    decode_instruction(opcode, &inst);
+
+    char op_enum[32];
+    int length = (int)strlen(op_names[inst.op]);
+    for (int i = 0; i <= length; i++) {
+        op_enum[i] = (char)toupper(op_names[inst.op][i]);
+    }
+
+    fprintf(out, "L_%03x: // %04x\n", address, opcode);
+    if (inst.op == OP_JP && may_close_idle_loop(address, inst.nnn)) {
+        fprintf(out, "    AOT_IDLE_LOOP(0x%03x);\n", address);
+    }
+    fprintf(out, "    AOT_STEP(0x%03x);\n", address);
+    if (inst.op != OP_JP && inst.op != OP_NOP) {
+        fprintf(out, "    AOT_EXEC(op_%s, OP_%s, 0x%x, 0x%x, 0x%x, 0x%02x, 0x%03x);\n",
+                op_names[inst.op], op_enum, inst.x, inst.y, inst.n, inst.kk, inst.nnn);
+    }
+
+    u16 next = address + 2;
+    switch (inst.op) {
+        case OP_JP:
+        case OP_CALL: {
+            write_label_goto(out, inst.nnn);
+            return;
+        } break;
+
+        // The handler already set the PC.
+        case OP_RET:
+        case OP_JP_V0: {
+            fprintf(out, "    goto dispatch;\n");
+            return;
+        } break;
+
+        // Parked, exited or halted: the instructions left would only run it again.
+        case OP_LD_VX_K: {
+            fprintf(out, "    if (state->waiting_key) return executed - skipped;\n");
+            fprintf(out, "    goto dispatch;\n");
+            return;
+        } break;
+
+        case OP_EXIT:
+        case OP_UNKNOWN: {
+            fprintf(out, "    return executed - skipped;\n");
+            return;
+        } break;
+
+        case OP_SE_VX_KK:
+        case OP_SNE_VX_KK:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+        case OP_SKP:
+        case OP_SKNP: {
+            if (is_compiled(address + 4)) {
+                fprintf(out, "    if (state->pc != 0x%03x) goto L_%03x;\n", next, address + 4);
+            } else {
+                fprintf(out, "    if (state->pc != 0x%03x) goto dispatch;\n", next);
+            }
+        } break;
+
+        case OP_LD_B_VX: {
+            fprintf(out, "    if (aot_writes_code(state->I, 3)) AOT_LEAVE();\n");
+        } break;
+
+        case OP_LD_I_VX: {
+            fprintf(out, "    if (aot_writes_code(state->I, %d)) AOT_LEAVE();\n", inst.x + 1);
+        } break;
+
+    }
+
+    if (next != next_compiled) {
+        write_label_goto(out, next);
+    }
+}
+
+static void write_run_function(FILE *out)
+{
+    fprintf(out,
+        "static u32 aot_run(Chip8_state *state, u32 count)\n"
+        "{\n"
+        "    if (!aot_code_intact(state)) {\n"
+        "        return run_instructions(state, count);\n"
+        "    }\n"
+        "\n"
+        "    u32 executed = 0; // Or skipped.\n"
+        "    u32 skipped = 0;\n"
+        "\n"
+        "dispatch:\n"
+        "    if (executed == count) {\n"
+        "        return executed - skipped;\n"
+        "    }\n"
+        "\n"
+        "    switch (state->pc) {\n");
+
+    for (int address = 0; address < MAX_MEMORY_SIZE; address++) {
+        if (reachable[address]) {
+            fprintf(out, "        case 0x%03x: goto L_%03x;\n", address, address);
+        }
+    }
+
+    fprintf(out,
+        "    }\n"
+        "\n"
+        "    // Not compiled, so interpret it.\n"
+        "    {\n"
+        "        Decoded_instruction *inst = fetch_decoded(state);\n"
+        "        int writes = (inst->op == OP_LD_B_VX) ? 3 : (inst->op == OP_LD_I_VX) ? inst->x + 1 : 0;\n"
+        "        u16 I = state->I;\n"
+        "\n"
+        "        emulate(state);\n"
+        "        executed++;\n"
+        "\n"
+        "        if (stopped_on(state, inst->op)) return executed - skipped;\n"
+        "        if (writes && aot_writes_code(I, writes)) AOT_LEAVE();\n"
+        "    }\n"
+        "    goto dispatch;\n"
+        "\n");
+
+    for (int address = 0; address < MAX_MEMORY_SIZE; address++) {
+        if (!reachable[address]) {
+            continue;
+        }
+
+        int next_compiled = address + 1;
+        while (next_compiled < MAX_MEMORY_SIZE && !reachable[next_compiled]) {
+            next_compiled++;
+        }
+
+        write_instruction(out, (u16)address, next_compiled);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out,
+        "}\n"
+        "\n"
+        "#undef AOT_IDLE_LOOP\n"
+        "#undef AOT_LEAVE\n"
+        "#undef AOT_EXEC\n"
+        "#undef AOT_STEP\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <rom> <output.cpp>\n", argv[0]);
+
+        exit(USAGE_ERROR);
+    }
+
+    FILE *rom = fopen(argv[1], "rb");
+    if (!rom) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+
+        exit(ROM_DOES_NOT_EXISTS);
+    }
+
+    size_t size = fread(memory + START_MEMORY, 1, MAX_MEMORY_SIZE - START_MEMORY, rom);
+    fclose(rom);
+    rom_end = (u16)(START_MEMORY + size);
+
+    find_reachable_code();
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "Cannot create %s\n", argv[2]);
+
+        exit(USAGE_ERROR);
+    }
+
+    fprintf(out, "// Generated by chip8-aot from %s. Do not edit.\n\n", argv[1]);
+    write_tables(out);
+    write_helpers(out);
+    write_run_function(out);
+    fclose(out);
+
+    return 0;
+}
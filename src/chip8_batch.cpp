@@ -0,0 +1,448 @@
+/*
+Batch runner: runs many ROMs headless, each on its own libchip8 instance, spread over
+all cores, and prints a hash of the final state of each one with some stats.
+
+Usage: chip8-batch [-j <threads>] [-n <instructions>] [--hz <instructions per second>]
+                   [--keys <script>] [--seed <seed>] [--snapshot <file> | --replay <movie>]
+                   [--profile <suffix>] [--jobs <file>] [<rom or directory>...]
+
+Every ROM given, or found in a given directory, is a job that runs -n instructions
+(1000000 by default) with the --keys script. A jobs file lists one job per line as
+"<rom> [<instructions> [<key script>]]" to set those per job.
+
+With --snapshot, jobs start from the snapshot instead of the reset machine (to skip an
+intro, say), and the key script frames count from there. Jobs of another ROM fail with
+error=6 (SNAPSHOT_MISMATCH).
+
+With --replay, jobs replay a movie recorded by the frontend's --record, as fast as they
+run: its seed, instructions per frame, keypad and length replace --seed, --hz, --keys and
+-n. Jobs of another ROM fail with error=8 (MOVIE_MISMATCH).
+
+With --profile, and libchip8 built with CHIP8_PROFILE, each job writes its profile to
+<rom><suffix>: "--profile .profile.json" writes roms/PONG.profile.json, say.
+
+A key script has a "<frame> <keys>" line per change of the keypad: from that 60 Hz
+frame on, the keys in the hex mask <keys> (bit k for key k) are held down.
+
+Jobs are dealt out evenly to one queue per worker thread. A worker takes jobs from the
+front of its own queue and, once it is empty, steals from the back of the others. A job
+parked on Fx0A runs no instruction until its script or movie presses a key, so it skips
+straight to that frame, or to the end of its budget. So does a job exited on 00FD.
+
+Output, one line per job in the order given:
+    rom=<path> hash=<hash_chip8()> instructions=<executed> frames=<frames> seconds=<time> error=<code>
+where the instructions skipped in idle loops or spent parked on Fx0A are not executed.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_core.h"
+#include "chip8_platform.h"
+
+#define USAGE_ERROR             1
+#define SCRIPT_ERROR            4
+
+#define FPS                     (60)
+#define DEFAULT_CPU_HZ          (600)   /* Instructions per second */
+#define DEFAULT_INSTRUCTIONS    (1000000)
+#define MAX_PATH_LENGTH         1024
+#define MAX_SKIPPED_FRAMES      (1u << 30) /* At once, for a parked job */
+
+struct Key_event {
+    u32 frame;
+    u16 keys; // Bit k set when key k is held down.
+};
+
+struct Key_script {
+    Key_event *events; // Sorted by frame.
+    int count;
+};
+
+struct Job {
+    char rom[MAX_PATH_LENGTH];
+    u64 instructions; // Budget.
+    Key_script *script; // Can be null.
+
+    // Results.
+    u64 hash;
+    u64 executed; // Not counting the instructions skipped or spent parked.
+    u32 frames;
+    double seconds;
+    int error;
+};
+
+struct Worker {
+    volatile s32 lock;
+
+    // Job indices. The owner takes them at head, thieves at tail.
+    int *queue;
+    int head;
+    int tail;
+
+    Thread thread;
+};
+
+static Job *jobs;
+static int job_count;
+static int job_capacity;
+
+static Worker *workers;
+static int worker_count;
+
+static u32 cycles_per_frame = DEFAULT_CPU_HZ / FPS;
+static u32 seed;
+static Chip8_snapshot *start_snapshot; // Can be null.
+static Chip8_movie *replay; // Can be null.
+static char *profile_suffix; // Can be null.
+
+static Key_script *load_key_script(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open key script %s\n", path);
+
+        exit(SCRIPT_ERROR);
+    }
+
+    Key_script *script = (Key_script *)calloc(1, sizeof(Key_script));
+    int capacity = 0;
+
+    u32 frame;
+    u32 keys;
+    while (fscanf(file, "%u %x", &frame, &keys) == 2) {
+        if (script->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            script->events = (Key_event *)realloc(script->events, capacity * sizeof(Key_event));
+        }
+
+        if (script->count > 0 && frame < script->events[script->count - 1].frame) {
+            fprintf(stderr, "Key script %s isn't sorted by frame\n", path);
+
+            exit(SCRIPT_ERROR);
+        }
+
+        script->events[script->count].frame = frame;
+        script->events[script->count].keys = (u16)keys;
+        script->count++;
+    }
+
+    fclose(file);
+
+    return script;
+}
+
+static void add_job(const char *rom, u64 instructions, Key_script *script)
+{
+    if (job_count == job_capacity) {
+        job_capacity = job_capacity ? job_capacity * 2 : 64;
+        jobs = (Job *)realloc(jobs, job_capacity * sizeof(Job));
+    }
+
+    Job *job = &jobs[job_count++];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->rom, sizeof(job->rom), "%s", rom);
+    job->instructions = instructions;
+    job->script = script;
+}
+
+struct Job_defaults {
+    u64 instructions;
+    Key_script *script;
+};
+
+static void add_directory_job(const char *path, void *data)
+{
+    Job_defaults *defaults = (Job_defaults *)data;
+    add_job(path, defaults->instructions, defaults->script);
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    return strcmp(((Job *)a)->rom, ((Job *)b)->rom);
+}
+
+static void load_jobs_file(const char *path, Job_defaults *defaults)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open jobs file %s\n", path);
+
+        exit(USAGE_ERROR);
+    }
+
+    char line[3 * MAX_PATH_LENGTH];
+    while (fgets(line, sizeof(line), file)) {
+        char rom[MAX_PATH_LENGTH];
+        unsigned long long instructions;
+        char script[MAX_PATH_LENGTH];
+
+        int fields = sscanf(line, "%1023s %llu %1023s", rom, &instructions, script);
+        if (fields < 1) {
+            continue;
+        }
+
+        add_job(rom,
+                (fields >= 2) ? (u64)instructions : defaults->instructions,
+                (fields >= 3) ? load_key_script(script) : defaults->script);
+    }
+
+    fclose(file);
+}
+
+struct Job_input {
+    Chip8_movie movie; // Own copy of replay, for its position.
+
+    Key_script *script;
+    int next_event;
+};
+
+static void update_keys(Job_input *input, Chip8_state *state, u32 frame)
+{
+    Key_script *script = input->script;
+    while (script && input->next_event < script->count && script->events[input->next_event].frame <= frame) {
+        state->keys = script->events[input->next_event].keys;
+        input->next_event++;
+    }
+}
+
+// Whole frames, at most frames, before the keys held next change.
+static u32 frames_until_keys(Job_input *input, Chip8_state *state, u32 frame, u32 frame_cycles, u64 frames)
+{
+    u64 until = frames;
+    Chip8_movie *movie = &input->movie;
+    Key_script *script = input->script;
+    if (replay && movie->next < movie->count) {
+        until = (movie->events[movie->next].cycle - state->cycles - 1) / frame_cycles + 1;
+    } else if (!replay && script && input->next_event < script->count) {
+        until = script->events[input->next_event].frame - frame;
+    }
+
+    if (until > frames) {
+        until = frames;
+    }
+
+    return (until < MAX_SKIPPED_FRAMES) ? (u32)until : MAX_SKIPPED_FRAMES;
+}
+
+static void run_job(Job *job)
+{
+    double start = get_seconds();
+
+    Chip8_state *state = (Chip8_state *)calloc(1, sizeof(Chip8_state));
+
+    Job_input input = {};
+    input.script = job->script;
+
+    u64 instructions = job->instructions;
+    u32 frame_cycles = cycles_per_frame;
+    if (replay) {
+        input.movie = *replay;
+        instructions = replay->length;
+        frame_cycles = replay->cycles_per_frame;
+    }
+
+    job->error = init_chip8(state, job->rom, 0);
+    if (!job->error) {
+        seed_chip8(state, replay ? replay->seed : seed);
+    }
+    if (!job->error && start_snapshot) {
+        job->error = restore_chip8(state, start_snapshot);
+    }
+    if (!job->error && replay && replay->rom_hash != state->rom_hash) {
+        job->error = MOVIE_MISMATCH;
+    }
+    if (!job->error) {
+        u64 used = 0; // Of the budget.
+        while (used < instructions && !state->error) {
+            if (replay) {
+                play_movie(&input.movie, state);
+            } else {
+                update_keys(&input, state, job->frames);
+            }
+
+            // Parked with no key held: go straight to the frame that changes the keys.
+            u64 left = instructions - used;
+            u32 frames = frames_until_keys(&input, state, job->frames, frame_cycles, left / frame_cycles);
+            frames = skip_chip8_frames(state, frames, frame_cycles);
+            if (frames) {
+                used += (u64)frames * frame_cycles;
+                job->frames += frames;
+                continue;
+            }
+
+            u32 count = (left < frame_cycles) ? (u32)left : frame_cycles;
+            job->executed += run_chip8(state, count);
+            end_chip8_frame(state);
+
+            used += count;
+            job->frames++;
+        }
+
+        job->error = state->error;
+        job->hash = hash_chip8(state);
+
+        if (profile_suffix) {
+            char path[MAX_PATH_LENGTH];
+            snprintf(path, sizeof(path), "%s%s", job->rom, profile_suffix);
+            if (write_profile(state, path)) {
+                fprintf(stderr, "Can't write %s (is libchip8 built with CHIP8_PROFILE?)\n", path);
+            }
+        }
+    }
+
+    free_chip8(state);
+    free(state);
+
+    job->seconds = get_seconds() - start;
+}
+
+// Returns the index of the next job for worker number index, or -1 when all are taken.
+static int take_job(int index)
+{
+    Worker *worker = &workers[index];
+    int job = -1;
+
+    lock(&worker->lock);
+    if (worker->head < worker->tail) {
+        job = worker->queue[worker->head++];
+    }
+    unlock(&worker->lock);
+
+    // Jobs are never added once running, so empty queues stay empty.
+    for (int i = 1; job == -1 && i < worker_count; i++) {
+        Worker *victim = &workers[(index + i) % worker_count];
+
+        lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            job = victim->queue[--victim->tail];
+        }
+        unlock(&victim->lock);
+    }
+
+    return job;
+}
+
+static void worker_proc(void *data)
+{
+    int index = (int)(size_t)data;
+
+    int job;
+    while ((job = take_job(index)) != -1) {
+        run_job(&jobs[job]);
+    }
+}
+
+static void usage(char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-j <threads>] [-n <instructions>] [--hz <instructions per second>]\n"
+            "          [--keys <script>] [--seed <seed>] [--snapshot <file> | --replay <movie>]\n"
+            "          [--profile <suffix>] [--jobs <file>] [<rom or directory>...]\n", program);
+
+    exit(USAGE_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+    Job_defaults defaults = {};
+    defaults.instructions = DEFAULT_INSTRUCTIONS;
+    worker_count = get_cpu_count();
+
+    // Options first, as they apply to every ROM given.
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 == argc) {
+            usage(argv[0]);
+        }
+
+        char *value = argv[++i];
+        if (strcmp(argv[i - 1], "-j") == 0 && atoi(value) > 0) {
+            worker_count = atoi(value);
+        } else if (strcmp(argv[i - 1], "-n") == 0 && strtoull(value, 0, 10) > 0) {
+            defaults.instructions = strtoull(value, 0, 10);
+        } else if (strcmp(argv[i - 1], "--hz") == 0 && atoi(value) > 0) {
+            cycles_per_frame = (atoi(value) + FPS - 1) / FPS;
+        } else if (strcmp(argv[i - 1], "--keys") == 0) {
+            defaults.script = load_key_script(value);
+        } else if (strcmp(argv[i - 1], "--snapshot") == 0) {
+            start_snapshot = (Chip8_snapshot *)malloc(sizeof(Chip8_snapshot));
+            if (read_snapshot(start_snapshot, value)) {
+                fprintf(stderr, "Can't read snapshot %s\n", value);
+
+                exit(SNAPSHOT_FILE_ERROR);
+            }
+        } else if (strcmp(argv[i - 1], "--seed") == 0) {
+            seed = (u32)strtoul(value, 0, 0);
+        } else if (strcmp(argv[i - 1], "--replay") == 0) {
+            replay = (Chip8_movie *)malloc(sizeof(Chip8_movie));
+            if (read_movie(replay, value)) {
+                fprintf(stderr, "Can't read movie %s\n", value);
+
+                exit(MOVIE_FILE_ERROR);
+            }
+        } else if (strcmp(argv[i - 1], "--profile") == 0) {
+            profile_suffix = value;
+        } else if (strcmp(argv[i - 1], "--jobs") == 0) {
+            load_jobs_file(value, &defaults);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    for (; i < argc; i++) {
+        int first = job_count;
+        if (list_directory(argv[i], add_directory_job, &defaults)) {
+            // Directory order depends on the file system.
+            qsort(jobs + first, job_count - first, sizeof(Job), compare_jobs);
+        } else {
+            add_job(argv[i], defaults.instructions, defaults.script);
+        }
+    }
+
+    // A movie starts from the reset machine.
+    if (job_count == 0 || (replay && start_snapshot) || (replay && replay->cycles_per_frame == 0)) {
+        usage(argv[0]);
+    }
+
+    if (worker_count > job_count) {
+        worker_count = job_count;
+    }
+
+    // Deal the jobs out round robin.
+    workers = (Worker *)calloc(worker_count, sizeof(Worker));
+    for (int w = 0; w < worker_count; w++) {
+        workers[w].queue = (int *)malloc((job_count / worker_count + 1) * sizeof(int));
+    }
+    for (int j = 0; j < job_count; j++) {
+        Worker *worker = &workers[j % worker_count];
+        worker->queue[worker->tail++] = j;
+    }
+
+    double start = get_seconds();
+
+    for (int w = 0; w < worker_count; w++) {
+        start_thread(&workers[w].thread, worker_proc, (void *)(size_t)w);
+    }
+    for (int w = 0; w < worker_count; w++) {
+        join_thread(&workers[w].thread);
+    }
+
+    double seconds = get_seconds() - start;
+
+    u64 total_instructions = 0;
+    for (int j = 0; j < job_count; j++) {
+        Job *job = &jobs[j];
+        printf("rom=%s hash=%016llx instructions=%llu frames=%u seconds=%.6f error=%d\n",
+               job->rom, (unsigned long long)job->hash, (unsigned long long)job->executed,
+               job->frames, job->seconds, job->error);
+        total_instructions += job->executed;
+    }
+
+    fprintf(stderr, "%d jobs on %d threads: %llu instructions in %.3f s, %.1f M instructions/s\n",
+            job_count, worker_count, (unsigned long long)total_instructions, seconds,
+            (double)total_instructions / seconds / 1e6);
+
+    return 0;
+}
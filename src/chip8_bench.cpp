@@ -0,0 +1,319 @@
+/*
+Benchmark: runs ROMs headless one after the other on one thread, each for a fixed number
+of instructions with a fixed seed and scripted keys, so that every run of a build does
+the same work, and reports how fast the core went.
+
+Usage: chip8-bench [-n <instructions>] [-r <runs>] [--seed <seed>] [--baseline <file>]
+                   <rom or directory>...
+
+The keys are scripted from the seed: every BENCH_KEY_FRAMES frames a new key, or none,
+is held down, so that games get past their title screens. Each ROM is run -r times (5 by
+default) and the fastest run is kept.
+
+Output, one line per ROM:
+    rom=<path> hash=<hash_chip8()> instructions=<executed> budget=<instructions>
+    seconds=<time> instructions_per_second=<rate> ns_per_instruction=<time>
+    dxyn_share=<share> [dxyn_time_share=<share>] peak_rss_kb=<size> error=<code>
+all on one line. budget is the instructions the machine went through, -n unless the ROM
+halted on error, and instructions those it executed, without the ones idle loops skipped
+or it spent parked on Fx0A. The rate and the time per instruction are of the executed ones.
+dxyn_share is the part of the instructions that were Dxyn, and dxyn_time_share the
+part of the time spent in them, with CHIP8_PROFILE builds only.
+peak_rss_kb is the peak of the whole process so far: run one ROM per process to get
+it per ROM, as "make bench" does.
+
+With --baseline, a file of such lines from an earlier run, every ROM in it is compared
+against its line there, adding:
+    baseline_ns_per_instruction=<time> change=<percent> status=<ok|mismatch>
+mismatch when the hash, instructions or budget differ, as the emulation did something
+else. Exits with BENCH_REGRESSION if any ROM is mismatched. The change in the time per
+instruction is only reported: on a shared machine it swings by more than any threshold
+that would catch a regression.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_core.h"
+#include "chip8_platform.h"
+
+#define USAGE_ERROR             1
+#define BENCH_REGRESSION        10
+
+#define CYCLES_PER_FRAME        (10)    /* 600 instructions per second */
+#define DEFAULT_INSTRUCTIONS    (5000000)
+#define DEFAULT_RUNS            5
+#define DEFAULT_SEED            1
+#define BENCH_KEY_FRAMES        (20)    /* Frames each scripted key is held for */
+#define MAX_PATH_LENGTH         1024
+
+struct Bench_result {
+    u64 hash;
+    u64 executed;
+    u64 budget;
+    u64 draws;
+    int error;
+    double seconds;
+    double dxyn_time_share; // Negative without CHIP8_PROFILE.
+};
+
+struct Baseline_entry {
+    char rom[MAX_PATH_LENGTH];
+    u64 hash;
+    u64 executed;
+    u64 budget;
+    double ns_per_instruction;
+};
+
+static Baseline_entry *baseline;
+static int baseline_count;
+
+static u64 instructions = DEFAULT_INSTRUCTIONS;
+static int runs = DEFAULT_RUNS;
+static u32 seed = DEFAULT_SEED;
+
+static int regressions;
+
+struct Bench_input {
+    u32 random_state;
+};
+
+// Holds a key, or none, picked by an xorshift32 of its own.
+static void update_keys(Bench_input *input, Chip8_state *state)
+{
+    u32 x = input->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    input->random_state = x;
+
+    u32 key = x % (KEY_NUMBER + 1);
+    state->keys = (key < KEY_NUMBER) ? (u16)(1 << key) : 0;
+}
+
+static int run_bench(const char *rom, Bench_result *result)
+{
+    Chip8_state *state = (Chip8_state *)calloc(1, sizeof(Chip8_state));
+
+    Bench_input input = {};
+    input.random_state = seed ? seed : 1;
+
+    int error = init_chip8(state, rom, 0);
+    if (error) {
+        free(state);
+        return error;
+    }
+    seed_chip8(state, seed);
+
+    double start = get_seconds();
+
+    u64 executed = 0;
+    u32 frame = 0;
+    while (state->cycles < instructions && !state->error) {
+        if (frame % BENCH_KEY_FRAMES == 0) {
+            update_keys(&input, state);
+        }
+
+        u64 left = instructions - state->cycles;
+        executed += run_chip8(state, (left < CYCLES_PER_FRAME) ? (u32)left : CYCLES_PER_FRAME);
+        end_chip8_frame(state);
+        frame++;
+    }
+
+    result->seconds = get_seconds() - start;
+    result->hash = hash_chip8(state);
+    result->executed = executed;
+    result->budget = state->cycles;
+    result->draws = state->draws;
+    result->error = state->error;
+
+    result->dxyn_time_share = -1;
+    Chip8_profile *profile = state->profile;
+    if (profile && profile->ticks) {
+        result->dxyn_time_share = (double)profile->drw_ticks / (double)profile->ticks;
+    }
+
+    free_chip8(state);
+    free(state);
+
+    return 0;
+}
+
+static void bench_rom(const char *rom)
+{
+    Bench_result best = {};
+    for (int run = 0; run < runs; run++) {
+        Bench_result result = {};
+        int error = run_bench(rom, &result);
+        if (error) {
+            fprintf(stderr, "Can't load %s\n", rom);
+            return;
+        }
+
+        if (run == 0 || result.seconds < best.seconds) {
+            best = result;
+        }
+    }
+
+    double executed = (double)(best.executed ? best.executed : 1);
+    double ns_per_instruction = best.seconds * 1e9 / executed;
+
+    printf("rom=%s hash=%016llx instructions=%llu budget=%llu seconds=%.6f instructions_per_second=%.0f "
+           "ns_per_instruction=%.3f dxyn_share=%.6f",
+           rom, (unsigned long long)best.hash, (unsigned long long)best.executed,
+           (unsigned long long)best.budget, best.seconds,
+           (best.seconds > 0) ? executed / best.seconds : 0.0, ns_per_instruction,
+           (double)best.draws / executed);
+    if (best.dxyn_time_share >= 0) {
+        printf(" dxyn_time_share=%.6f", best.dxyn_time_share);
+    }
+    printf(" peak_rss_kb=%llu error=%d", (unsigned long long)get_peak_rss(), best.error);
+
+    for (int i = 0; i < baseline_count; i++) {
+        Baseline_entry *entry = &baseline[i];
+        if (strcmp(entry->rom, rom) != 0) {
+            continue;
+        }
+
+        double change = (ns_per_instruction / entry->ns_per_instruction - 1.0) * 100.0;
+        int matches = entry->hash == best.hash && entry->executed == best.executed && entry->budget == best.budget;
+        if (!matches) {
+            regressions++;
+        }
+
+        printf(" baseline_ns_per_instruction=%.3f change=%+.1f%% status=%s",
+               entry->ns_per_instruction, change, matches ? "ok" : "mismatch");
+        break;
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+// Reads the lines of an earlier run. Lines without a rom, hash, counts and time are skipped.
+static void load_baseline(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open baseline %s\n", path);
+
+        exit(USAGE_ERROR);
+    }
+
+    int capacity = 0;
+    char line[4 * MAX_PATH_LENGTH];
+    while (fgets(line, sizeof(line), file)) {
+        char *rom = strstr(line, "rom=");
+        char *hash = strstr(line, " hash=");
+        char *executed = strstr(line, " instructions=");
+        char *budget = strstr(line, " budget=");
+        char *time = strstr(line, " ns_per_instruction=");
+        if (!rom || !hash || !executed || !budget || !time) {
+            continue;
+        }
+
+        if (baseline_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            baseline = (Baseline_entry *)realloc(baseline, capacity * sizeof(Baseline_entry));
+        }
+
+        Baseline_entry *entry = &baseline[baseline_count];
+        unsigned long long hash_value;
+        unsigned long long executed_value;
+        unsigned long long budget_value;
+        if (sscanf(rom, "rom=%1023s", entry->rom) != 1 ||
+            sscanf(hash, " hash=%llx", &hash_value) != 1 ||
+            sscanf(executed, " instructions=%llu", &executed_value) != 1 ||
+            sscanf(budget, " budget=%llu", &budget_value) != 1 ||
+            sscanf(time, " ns_per_instruction=%lf", &entry->ns_per_instruction) != 1 ||
+            entry->ns_per_instruction <= 0) {
+            continue;
+        }
+
+        entry->hash = (u64)hash_value;
+        entry->executed = (u64)executed_value;
+        entry->budget = (u64)budget_value;
+        baseline_count++;
+    }
+
+    fclose(file);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+struct Rom_list {
+    char (*paths)[MAX_PATH_LENGTH];
+    int count;
+    int capacity;
+};
+
+static void add_rom(const char *path, void *data)
+{
+    Rom_list *list = (Rom_list *)data;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->paths = (char (*)[MAX_PATH_LENGTH])realloc(list->paths, list->capacity * MAX_PATH_LENGTH);
+    }
+
+    snprintf(list->paths[list->count++], MAX_PATH_LENGTH, "%s", path);
+}
+
+static void usage(char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-n <instructions>] [-r <runs>] [--seed <seed>] [--baseline <file>]\n"
+            "          <rom or directory>...\n", program);
+
+    exit(USAGE_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 == argc) {
+            usage(argv[0]);
+        }
+
+        char *value = argv[++i];
+        if (strcmp(argv[i - 1], "-n") == 0 && strtoull(value, 0, 10) > 0) {
+            instructions = strtoull(value, 0, 10);
+        } else if (strcmp(argv[i - 1], "-r") == 0 && atoi(value) > 0) {
+            runs = atoi(value);
+        } else if (strcmp(argv[i - 1], "--seed") == 0) {
+            seed = (u32)strtoul(value, 0, 0);
+        } else if (strcmp(argv[i - 1], "--baseline") == 0) {
+            load_baseline(value);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (i == argc) {
+        usage(argv[0]);
+    }
+
+    Rom_list roms = {};
+    for (; i < argc; i++) {
+        int first = roms.count;
+        if (list_directory(argv[i], add_rom, &roms)) {
+            // Directory order depends on the file system.
+            qsort(roms.paths + first, roms.count - first, MAX_PATH_LENGTH, compare_paths);
+        } else {
+            add_rom(argv[i], &roms);
+        }
+    }
+
+    for (int r = 0; r < roms.count; r++) {
+        bench_rom(roms.paths[r]);
+    }
+
+    free(roms.paths);
+    free(baseline);
+
+    return regressions ? BENCH_REGRESSION : 0;
+}
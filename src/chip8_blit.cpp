@@ -0,0 +1,134 @@
+/*
+Sprite blitter for Dxyn.
+
+XORs a run of sprite rows, 8 or 16 pixels wide, into consecutive screen rows and reports
+whether any set pixel was erased. A screen row is two words, handled as one 128-bit
+value. On x86 the rows are processed two at a time with AVX2 when the CPU supports it,
+one at a time with SSE2 otherwise, and with plain 64-bit arithmetic elsewhere.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CHIP8_X86
+#endif
+
+#ifdef CHIP8_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+/*
+rows[i] ^= sprite[i] << shift for every i < n, rows[i] being the 128-bit value of the
+two words of row i, the first one high. Returns non-zero if any pixel set before the
+XOR was set in the sprite as well.
+*/
+typedef u64 (*Blit_fn)(u64 *rows, u16 *sprite, int n, int shift);
+
+static u64 blit_rows_scalar(u64 *rows, u16 *sprite, int n, int shift)
+{
+    u64 collision = 0;
+
+    for (int i = 0; i < n; i++) {
+        u64 bits = sprite[i];
+        u64 high = (shift >= 64) ? bits << (shift - 64) : (shift > 0) ? bits >> (64 - shift) : 0;
+        u64 low = (shift < 64) ? bits << shift : 0;
+
+        u64 *row = rows + 2*i;
+        collision |= (row[0] & high) | (row[1] & low);
+        row[0] ^= high;
+        row[1] ^= low;
+    }
+
+    return collision;
+}
+
+#ifdef CHIP8_X86
+/*
+The sprite row is shifted as a 64-bit value into each word, and shifts by 64 or more give
+0, so the two words need no branch: the high one takes sprite << (shift - 64) or
+sprite >> (64 - shift), whichever count is below 64, and the low one sprite << shift.
+*/
+static u64 blit_rows_sse2(u64 *rows, u16 *sprite, int n, int shift)
+{
+    __m128i high_left = _mm_cvtsi32_si128((shift >= 64) ? shift - 64 : 64);
+    __m128i high_right = _mm_cvtsi32_si128((shift >= 64) ? 64 : 64 - shift);
+    __m128i low_left = _mm_cvtsi32_si128(shift);
+    __m128i collision = _mm_setzero_si128();
+
+    for (int i = 0; i < n; i++) {
+        __m128i sprite_row = _mm_set1_epi64x(sprite[i]);
+        __m128i high = _mm_or_si128(_mm_sll_epi64(sprite_row, high_left), _mm_srl_epi64(sprite_row, high_right));
+        __m128i bits = _mm_unpacklo_epi64(high, _mm_sll_epi64(sprite_row, low_left));
+        __m128i screen = _mm_loadu_si128((__m128i *)(rows + 2*i));
+
+        collision = _mm_or_si128(collision, _mm_and_si128(screen, bits));
+        _mm_storeu_si128((__m128i *)(rows + 2*i), _mm_xor_si128(screen, bits));
+    }
+
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(collision, _mm_setzero_si128())) != 0xFFFF);
+}
+
+// The same with per-word shift counts, for two rows at a time.
+static TARGET_AVX2 u64 blit_rows_avx2(u64 *rows, u16 *sprite, int n, int shift)
+{
+    long long high_left = (shift >= 64) ? shift - 64 : 64;
+    long long high_right = (shift >= 64) ? 64 : 64 - shift;
+    __m256i left = _mm256_set_epi64x(shift, high_left, shift, high_left);
+    __m256i right = _mm256_set_epi64x(64, high_right, 64, high_right);
+    __m256i collision = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256i sprite_rows = _mm256_set_epi64x(sprite[i + 1], sprite[i + 1], sprite[i], sprite[i]);
+        __m256i bits = _mm256_or_si256(_mm256_sllv_epi64(sprite_rows, left), _mm256_srlv_epi64(sprite_rows, right));
+        __m256i screen = _mm256_loadu_si256((__m256i *)(rows + 2*i));
+
+        collision = _mm256_or_si256(collision, _mm256_and_si256(screen, bits));
+        _mm256_storeu_si256((__m256i *)(rows + 2*i), _mm256_xor_si256(screen, bits));
+    }
+
+    u64 result = !_mm256_testz_si256(collision, collision);
+
+    return result | blit_rows_sse2(rows + 2*i, sprite + i, n - i, shift);
+}
+
+static int cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return 0;
+    }
+
+    // The OS must save the YMM registers (OSXSAVE, then XCR0 bits 1 and 2).
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+        return 0;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init(); // Needed as this runs before main().
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Picks the fastest blitter the CPU supports.
+static Blit_fn blit_select()
+{
+#ifdef CHIP8_X86
+    return cpu_has_avx2() ? blit_rows_avx2 : blit_rows_sse2;
+#else
+    return blit_rows_scalar;
+#endif
+}
+
+// Chosen once at startup, before any thread can run an instance.
+static const Blit_fn blit_rows = blit_select();
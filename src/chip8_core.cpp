@@ -0,0 +1,1210 @@
+/*
+libchip8: the CHIP-8 interpreter and everything it needs, without any frontend code.
+See chip8_core.h for the interface.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_core.h"
+
+#define RANDOM_SEED             (0x2545F491) /* Any non-zero value */
+
+// Each font is made of 5 8-bit values (1 byte for each row), ranging from 0 to F.
+#define FONT_SIZE_BYTES         5
+#define FONTS_MEMORY_SIZE       (FONT_SIZE_BYTES * 16)
+static const u8 fonts[FONTS_MEMORY_SIZE] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80, // F
+};
+
+// SUPER-CHIP big fonts for Fx30, 8x10 and right after the small ones. SUPER-CHIP 1.1 has
+// only the digits; A to F are the usual extension.
+#define BIG_FONT_SIZE_BYTES     10
+#define BIG_FONTS_ADDRESS       FONTS_MEMORY_SIZE
+#define BIG_FONTS_MEMORY_SIZE   (BIG_FONT_SIZE_BYTES * 16)
+static const u8 big_fonts[BIG_FONTS_MEMORY_SIZE] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0, // F
+};
+
+static inline int is_key_down(Chip8_state *state, u8 key)
+{
+    return key < KEY_NUMBER && (state->keys & (1 << key));
+}
+
+static inline void mark_rows_dirty(Chip8_state *state, u64 rows)
+{
+    state->screen_dirty = 1;
+    state->dirty_rows |= rows;
+}
+
+static void clear_screen(Chip8_state *state)
+{
+    memset(state->screen, 0, sizeof(state->screen));
+    mark_rows_dirty(state, ~(u64)0);
+}
+
+static u16 fetch_opcode(Chip8_state *state, u16 address)
+{
+    return state->memory[MEMORY_ADDRESS(address)] << 8 | state->memory[MEMORY_ADDRESS(address + 1)];
+}
+
+// Drops the cached decoding of every instruction that overlaps memory[address..address+count-1].
+static void invalidate_decoded(Chip8_state *state, u16 address, int count)
+{
+    // The instruction starting one byte before the write overlaps it as well.
+    for (int i = -1; i < count; i++) {
+        state->decoded[MEMORY_ADDRESS(address + i)].op = OP_NONE;
+    }
+}
+
+
+static inline Decoded_instruction *fetch_decoded_at(Chip8_state *state, u16 address)
+{
+    Decoded_instruction *inst = &state->decoded[MEMORY_ADDRESS(address)];
+    if (inst->op == OP_NONE) {
+        decode_instruction(fetch_opcode(state, address), inst);
+    }
+
+    return inst;
+}
+
+static inline Decoded_instruction *fetch_decoded(Chip8_state *state)
+{
+    return fetch_decoded_at(state, state->pc);
+}
+
+static inline u32 next_random(Chip8_state *state)
+{
+    u32 x = state->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state->random_state = x;
+
+    return x;
+}
+
+// Advances the timers by one 60 Hz tick. Called once per frame, not per instruction.
+static inline void tick_timers(Chip8_state *state)
+{
+    state->ticks++;
+}
+
+#include "chip8_blit.cpp"
+
+/*
+XORs the width pixels of bits (leftmost in the top bit) into row y at x, where x + width
+doesn't pass the right edge. Returns non-zero if a set pixel was erased.
+*/
+static inline u64 xor_screen_row(Chip8_state *state, int y, int x, u16 bits, int width)
+{
+    return blit_rows_scalar(state->screen[y], &bits, 1, SCREEN_WIDTH - width - x);
+}
+
+/*
+Instruction handlers. They run with the PC already pointing past the instruction,
+and are shared by every dispatch strategy below.
+*/
+
+// 00E0: Clear the display.
+static inline void op_cls(Chip8_state *state, Decoded_instruction *inst)
+{
+    clear_screen(state);
+}
+
+// 00EE: Return from a subroutine.
+static inline void op_ret(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->sp = (u8)((state->sp - 1) & (STACK_DEPTH - 1));
+    state->pc = state->stack[state->sp];
+}
+
+// 1nnn: Jump to location nnn.
+static inline void op_jp(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->pc = inst->nnn;
+}
+
+// 2nnn: Call subroutine at nnn.
+static inline void op_call(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->stack[state->sp] = state->pc;
+    state->sp = (u8)((state->sp + 1) & (STACK_DEPTH - 1));
+    state->pc = inst->nnn;
+}
+
+// 3xkk: Skip next instruction if Vx = kk.
+static inline void op_se_vx_kk(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (state->V[inst->x] == inst->kk) {
+        state->pc += 2;
+    }
+}
+
+// 4xkk: Skip next instruction if Vx != kk.
+static inline void op_sne_vx_kk(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (state->V[inst->x] != inst->kk) {
+        state->pc += 2;
+    }
+}
+
+// 5xy0: Skip next instruction if Vx = Vy.
+static inline void op_se_vx_vy(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (state->V[inst->x] == state->V[inst->y]) {
+        state->pc += 2;
+    }
+}
+
+// 6xkk: Set Vx = kk.
+static inline void op_ld_vx_kk(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] = inst->kk;
+}
+
+// 7xkk: Set Vx = Vx + kk.
+static inline void op_add_vx_kk(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] += inst->kk;
+}
+
+// 8xy0: Set Vx = Vy.
+static inline void op_ld_vx_vy(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] = state->V[inst->y];
+}
+
+// 8xy1: Set Vx = Vx OR Vy.
+static inline void op_or(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] |= state->V[inst->y];
+}
+
+// 8xy2: Set Vx = Vx AND Vy.
+static inline void op_and(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] &= state->V[inst->y];
+}
+
+// 8xy3: Set Vx = Vx XOR Vy.
+static inline void op_xor(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] ^= state->V[inst->y];
+}
+
+// 8xy4: Set Vx = Vx + Vy, set VF = carry.
+static inline void op_add_vx_vy(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] += state->V[inst->y];
+
+    state->V[0xF] = (state->V[inst->x] < state->V[inst->y]); // Carry
+}
+
+// 8xy5: Set Vx = Vx - Vy, set VF = NOT borrow.
+static inline void op_sub(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[0xF] = (state->V[inst->x] >= state->V[inst->y]);
+
+    state->V[inst->x] -= state->V[inst->y];
+}
+
+// 8xy6: Set Vx = Vx SHR 1.
+static inline void op_shr(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[0xF] = (state->V[inst->x] & 1); // If least-significant bit is 1
+
+    state->V[inst->x] >>= 1;
+}
+
+// 8xy7: Set Vx = Vy - Vx, set VF = NOT borrow.
+static inline void op_subn(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[0xF] = (state->V[inst->y] >= state->V[inst->x]);
+
+    state->V[inst->x] = state->V[inst->y] - state->V[inst->x];
+}
+
+// 8xyE: Set Vx = Vx SHL 1.
+static inline void op_shl(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[0xF] = (state->V[inst->x] >> 7); // If most-significant bit is 1
+
+    state->V[inst->x] <<= 1;
+}
+
+// 9xy0: Skip next instruction if Vx != Vy.
+static inline void op_sne_vx_vy(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (state->V[inst->x] != state->V[inst->y]) {
+        state->pc += 2;
+    }
+}
+
+// Annn: Set I = nnn.
+static inline void op_ld_i(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->I = inst->nnn;
+}
+
+// Bnnn: Jump to location nnn + V0.
+static inline void op_jp_v0(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->pc = inst->nnn + state->V[0];
+}
+
+// Cxkk: Set Vx = random byte AND kk.
+static inline void op_rnd(Chip8_state *state, Decoded_instruction *inst)
+{
+    u8 random = next_random(state) % 0xFF;
+    state->V[inst->x] = random & inst->kk;
+}
+
+// Dxyn: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
+// Dxy0 draws 16 rows: a 16x16 sprite of 2 bytes per row in high resolution, 8x16 in low.
+static inline void op_drw(Chip8_state *state, Decoded_instruction *inst)
+{
+    u8 vx = state->V[inst->x];
+    u8 vy = state->V[inst->y];
+
+    int width = get_screen_width(state);
+    int height = get_screen_height(state);
+    int rows = inst->n ? inst->n : 16;
+    int sprite_width = (inst->n == 0 && state->hires) ? 16 : 8;
+
+    u16 sprite[16];
+    for (int row = 0; row < rows; row++) {
+        if (sprite_width == 16) {
+            sprite[row] = (u16)(state->memory[MEMORY_ADDRESS(state->I + 2*row)] << 8 |
+                                state->memory[MEMORY_ADDRESS(state->I + 2*row + 1)]);
+        } else {
+            sprite[row] = state->memory[MEMORY_ADDRESS(state->I + row)];
+        }
+    }
+
+    u64 collision = 0;
+    state->draws++;
+
+    // Every row of the sprite starts at the same x, so when none of them crosses the
+    // right edge or the bottom of the screen it is blitted in one go.
+    int start = (vy * width + vx) % (width * height);
+    if (start % width <= width - sprite_width && start / width + rows <= height) {
+        collision = blit_rows(state->screen[start / width], sprite, rows, SCREEN_WIDTH - sprite_width - start % width);
+        mark_rows_dirty(state, (((u64)1 << rows) - 1) << (start / width));
+        state->V[0xF] = (collision != 0);
+        return;
+    }
+
+    for (int row = 0; row < rows; row++) {
+        // Pixels past the screen size wrap around linearly, so a sprite row that goes
+        // past the right edge continues at the start of the next screen row.
+        int position = ((vy + row) * width + vx) % (width * height);
+        int y = position / width;
+        int x = position % width;
+
+        if (x <= width - sprite_width) {
+            collision |= xor_screen_row(state, y, x, sprite[row], sprite_width);
+        } else {
+            int inside = width - x;
+            int spilled = sprite_width - inside;
+            collision |= xor_screen_row(state, y, x, (u16)(sprite[row] >> spilled), inside);
+
+            int next = (y + 1) % height;
+            collision |= xor_screen_row(state, next, 0, (u16)(sprite[row] & ((1 << spilled) - 1)), spilled);
+            mark_rows_dirty(state, (u64)1 << next);
+        }
+
+        mark_rows_dirty(state, (u64)1 << y);
+    }
+
+    state->V[0xF] = (collision != 0);
+}
+
+// Ex9E: Skip next instruction if key with the value of Vx is pressed.
+static inline void op_skp(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (is_key_down(state, state->V[inst->x])) {
+        state->pc += 2;
+    }
+}
+
+// ExA1: Skip next instruction if key with the value of Vx is not pressed.
+static inline void op_sknp(Chip8_state *state, Decoded_instruction *inst)
+{
+    if (!is_key_down(state, state->V[inst->x])) {
+        state->pc += 2;
+    }
+}
+
+// Fx07: Set Vx = delay timer value.
+static inline void op_ld_vx_dt(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->V[inst->x] = get_delay_timer(state);
+}
+
+// Fx0A: Wait for a key press, store the value of the key in Vx (the lowest of those held).
+static inline void op_ld_vx_k(Chip8_state *state, Decoded_instruction *inst)
+{
+    // Without a key the machine parks on the instruction, and the frontend gets control
+    // back: the keys can only change between frames.
+    if (!state->keys) {
+        state->pc -= 2;
+        state->waiting_key = 1;
+        state->idle = 1;
+        return;
+    }
+
+    u8 key = 0;
+    while (!(state->keys & (1 << key))) {
+        key++;
+    }
+
+    state->waiting_key = 0;
+    state->V[inst->x] = key;
+}
+
+// Fx15: Set delay timer = Vx.
+static inline void op_ld_dt_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->delay_timer = state->V[inst->x];
+    state->delay_timer_tick = state->ticks;
+}
+
+// Fx18: Set sound timer = Vx.
+static inline void op_ld_st_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->sound_timer = state->V[inst->x];
+    state->sound_timer_tick = state->ticks;
+}
+
+// Fx1E: Set I = I + Vx.
+static inline void op_add_i_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->I += state->V[inst->x];
+}
+
+// Fx29: Set I to the memory address of the sprite data corresponding to the hexadecimal digit stored in register VX.
+static inline void op_ld_f_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->I = (state->V[inst->x] * FONT_SIZE_BYTES);
+}
+
+// Fx33: Store BCD representation of Vx in memory locations I, I+1, and I+2.
+// Takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.
+static inline void op_ld_b_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    u8 vx = state->V[inst->x];
+    state->memory[MEMORY_ADDRESS(state->I)] = vx / 100;
+    vx = vx % 100;
+    state->memory[MEMORY_ADDRESS(state->I + 1)] = vx / 10;
+    vx = vx % 10;
+    state->memory[MEMORY_ADDRESS(state->I + 2)] = vx;
+
+    invalidate_decoded(state, state->I, 3);
+}
+
+// Fx55: Store the values of registers V0 to VX inclusive in memory starting at address I.
+static inline void op_ld_i_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int i = 0; i <= inst->x; i++) {
+        state->memory[MEMORY_ADDRESS(state->I + i)] = state->V[i];
+    }
+
+    invalidate_decoded(state, state->I, inst->x + 1);
+}
+
+// Fx65: Fill registers V0 to VX inclusive with the values stored in memory starting at address I.
+static inline void op_ld_vx_i(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int i = 0; i <= inst->x; i++) {
+        state->V[i] = state->memory[MEMORY_ADDRESS(state->I + i)];
+    }
+}
+
+// 00Cn: Scroll the screen down n rows (SUPER-CHIP).
+static inline void op_scd(Chip8_state *state, Decoded_instruction *inst)
+{
+    int height = get_screen_height(state);
+    int n = (inst->n < height) ? inst->n : height;
+
+    memmove(state->screen[n], state->screen[0], (height - n) * sizeof(state->screen[0]));
+    memset(state->screen[0], 0, n * sizeof(state->screen[0]));
+    mark_rows_dirty(state, ~(u64)0);
+}
+
+// 00FB: Scroll the screen right 4 pixels (SUPER-CHIP).
+static inline void op_scr(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int y = 0; y < get_screen_height(state); y++) {
+        u64 *row = state->screen[y];
+        row[1] = state->hires ? (row[1] >> 4 | row[0] << 60) : 0;
+        row[0] >>= 4;
+    }
+
+    mark_rows_dirty(state, ~(u64)0);
+}
+
+// 00FC: Scroll the screen left 4 pixels (SUPER-CHIP).
+static inline void op_scl(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int y = 0; y < get_screen_height(state); y++) {
+        u64 *row = state->screen[y];
+        row[0] = row[0] << 4 | row[1] >> 60;
+        row[1] <<= 4;
+    }
+
+    mark_rows_dirty(state, ~(u64)0);
+}
+
+// 00FD: Exit the interpreter (SUPER-CHIP). The machine stops on it until a reset.
+static inline void op_exit(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->pc -= 2;
+    state->exited = 1;
+    state->idle = 1;
+}
+
+// 00FE / 00FF: Switch to the 64x32 / 128x64 screen (SUPER-CHIP). The screen is cleared,
+// as the low resolution one is only the top-left corner of the other.
+static inline void op_low(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->hires = 0;
+    clear_screen(state);
+}
+
+static inline void op_high(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->hires = 1;
+    clear_screen(state);
+}
+
+// Fx30: Set I to the big font sprite of the digit in Vx (SUPER-CHIP).
+static inline void op_ld_hf_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->I = (u16)(BIG_FONTS_ADDRESS + state->V[inst->x] * BIG_FONT_SIZE_BYTES);
+}
+
+// Fx75: Store V0 to Vx in the RPL user flags, x being at most 7 (SUPER-CHIP).
+static inline void op_ld_r_vx(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int i = 0; i <= inst->x && i < RPL_FLAG_COUNT; i++) {
+        state->rpl[i] = state->V[i];
+    }
+}
+
+// Fx85: Read V0 to Vx from the RPL user flags, x being at most 7 (SUPER-CHIP).
+static inline void op_ld_vx_r(Chip8_state *state, Decoded_instruction *inst)
+{
+    for (int i = 0; i <= inst->x && i < RPL_FLAG_COUNT; i++) {
+        state->V[i] = state->rpl[i];
+    }
+}
+
+// Unassigned opcode inside a known group: ignored.
+static inline void op_nop(Chip8_state *state, Decoded_instruction *inst)
+{
+}
+
+// Unknown opcode: the machine halts on it and reports the error.
+static void op_unknown(Chip8_state *state, Decoded_instruction *inst)
+{
+    state->pc -= 2;
+    state->error = UNKNOWN_OPCODE;
+}
+
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CHIP8_COMPUTED_GOTO
+#endif
+
+#ifndef CHIP8_COMPUTED_GOTO
+typedef void (*Op_handler)(Chip8_state *state, Decoded_instruction *inst);
+
+// Indexed by Op_kind.
+static Op_handler op_handlers[OP_COUNT] = {
+    op_unknown,   // Never dispatched: fetch_decoded() decodes first.
+    op_cls,
+    op_ret,
+    op_jp,
+    op_call,
+    op_se_vx_kk,
+    op_sne_vx_kk,
+    op_se_vx_vy,
+    op_ld_vx_kk,
+    op_add_vx_kk,
+    op_ld_vx_vy,
+    op_or,
+    op_and,
+    op_xor,
+    op_add_vx_vy,
+    op_sub,
+    op_shr,
+    op_subn,
+    op_shl,
+    op_sne_vx_vy,
+    op_ld_i,
+    op_jp_v0,
+    op_rnd,
+    op_drw,
+    op_skp,
+    op_sknp,
+    op_ld_vx_dt,
+    op_ld_vx_k,
+    op_ld_dt_vx,
+    op_ld_st_vx,
+    op_add_i_vx,
+    op_ld_f_vx,
+    op_ld_b_vx,
+    op_ld_i_vx,
+    op_ld_vx_i,
+    op_scd,
+    op_scr,
+    op_scl,
+    op_exit,
+    op_low,
+    op_high,
+    op_ld_hf_vx,
+    op_ld_r_vx,
+    op_ld_vx_r,
+    op_nop,
+    op_unknown,
+};
+#endif
+
+
+static void emulate(Chip8_state *state)
+{
+    Decoded_instruction *inst = fetch_decoded(state);
+    state->pc += 2;
+
+    switch (inst->op) {
+        case OP_CLS: op_cls(state, inst); break;
+        case OP_RET: op_ret(state, inst); break;
+        case OP_JP: op_jp(state, inst); break;
+        case OP_CALL: op_call(state, inst); break;
+        case OP_SE_VX_KK: op_se_vx_kk(state, inst); break;
+        case OP_SNE_VX_KK: op_sne_vx_kk(state, inst); break;
+        case OP_SE_VX_VY: op_se_vx_vy(state, inst); break;
+        case OP_LD_VX_KK: op_ld_vx_kk(state, inst); break;
+        case OP_ADD_VX_KK: op_add_vx_kk(state, inst); break;
+        case OP_LD_VX_VY: op_ld_vx_vy(state, inst); break;
+        case OP_OR: op_or(state, inst); break;
+        case OP_AND: op_and(state, inst); break;
+        case OP_XOR: op_xor(state, inst); break;
+        case OP_ADD_VX_VY: op_add_vx_vy(state, inst); break;
+        case OP_SUB: op_sub(state, inst); break;
+        case OP_SHR: op_shr(state, inst); break;
+        case OP_SUBN: op_subn(state, inst); break;
+        case OP_SHL: op_shl(state, inst); break;
+        case OP_SNE_VX_VY: op_sne_vx_vy(state, inst); break;
+        case OP_LD_I: op_ld_i(state, inst); break;
+        case OP_JP_V0: op_jp_v0(state, inst); break;
+        case OP_RND: op_rnd(state, inst); break;
+        case OP_DRW: op_drw(state, inst); break;
+        case OP_SKP: op_skp(state, inst); break;
+        case OP_SKNP: op_sknp(state, inst); break;
+        case OP_LD_VX_DT: op_ld_vx_dt(state, inst); break;
+        case OP_LD_VX_K: op_ld_vx_k(state, inst); break;
+        case OP_LD_DT_VX: op_ld_dt_vx(state, inst); break;
+        case OP_LD_ST_VX: op_ld_st_vx(state, inst); break;
+        case OP_ADD_I_VX: op_add_i_vx(state, inst); break;
+        case OP_LD_F_VX: op_ld_f_vx(state, inst); break;
+        case OP_LD_B_VX: op_ld_b_vx(state, inst); break;
+        case OP_LD_I_VX: op_ld_i_vx(state, inst); break;
+        case OP_LD_VX_I: op_ld_vx_i(state, inst); break;
+        case OP_SCD: op_scd(state, inst); break;
+        case OP_SCR: op_scr(state, inst); break;
+        case OP_SCL: op_scl(state, inst); break;
+        case OP_EXIT: op_exit(state, inst); break;
+        case OP_LOW: op_low(state, inst); break;
+        case OP_HIGH: op_high(state, inst); break;
+        case OP_LD_HF_VX: op_ld_hf_vx(state, inst); break;
+        case OP_LD_R_VX: op_ld_r_vx(state, inst); break;
+        case OP_LD_VX_R: op_ld_vx_r(state, inst); break;
+        case OP_NOP: op_nop(state, inst); break;
+        default: op_unknown(state, inst); break;
+    }
+}
+
+// After op, whether the machine stopped: parked on Fx0A, exited on 00FD, or halted on an
+// unknown opcode. The instructions left would only run it again.
+static inline int stopped_on(Chip8_state *state, u8 op)
+{
+    return (op == OP_LD_VX_K && state->waiting_key) || op == OP_EXIT || op == OP_UNKNOWN;
+}
+
+/*
+Idle loops: a short backward 1nnn whose body only reads registers, memory, the delay
+timer or the keys, and writes registers, like the Fx07 / 3xkk / 1nnn wait for the delay
+timer. The timers tick and the keys change between frames only, so once an iteration
+leaves the registers as they were, every iteration left in the frame does the same.
+Those are skipped: the loop goes on at the next frame as if they had run.
+The body is bounded by IDLE_MAX_BODY and made of is_idle_op() instructions (see
+chip8_decode.h, shared with chip8-aot).
+*/
+
+/*
+Called on the jump at state->pc, with left instructions to run including it. Runs one
+iteration of the loop, and if it is idle, skips the whole iterations left. Returns how
+many instructions were run or skipped, 0 when the jump doesn't close an idle loop, and
+adds those skipped to *skipped.
+*/
+static u32 run_idle_loop(Chip8_state *state, Decoded_instruction *jump, u32 left, u32 *skipped)
+{
+    u16 pc = state->pc;
+    u16 target = jump->nnn;
+    if (target > pc || pc - target > 2 * IDLE_MAX_BODY) {
+        return 0;
+    }
+
+    for (u16 address = target; address < pc; address += 2) {
+        if (!is_idle_op(fetch_decoded_at(state, address)->op)) {
+            return 0;
+        }
+    }
+
+    u8 V[16];
+    memcpy(V, state->V, sizeof(V));
+    u16 I = state->I;
+
+    // Skips only go forward, so the iteration ends at the jump or out of the loop.
+    u32 executed = 0;
+    do {
+        emulate(state);
+        executed++;
+
+        if (state->pc < target || state->pc > pc || executed == left) {
+            return executed;
+        }
+    } while (state->pc != pc);
+
+    if (memcmp(V, state->V, sizeof(V)) != 0 || I != state->I) {
+        return executed;
+    }
+
+    state->idle = 1;
+
+    u32 skip = (left - executed) / executed * executed;
+    *skipped += skip;
+
+    return executed + skip;
+}
+
+/*
+Direct-threaded interpreter core: every handler jumps straight to the handler of the
+next instruction, instead of going back through a central switch. Uses computed goto
+where the compiler supports it, and a function pointer table otherwise.
+Runs count instructions and returns how many were executed, not counting those skipped.
+*/
+static u32 emulate_threaded(Chip8_state *state, u32 count)
+{
+    u32 executed = 0; // Or skipped.
+    u32 skipped = 0;
+
+#ifdef CHIP8_COMPUTED_GOTO
+    static void *labels[OP_COUNT] = {
+        &&label_unknown,
+        &&label_cls,
+        &&label_ret,
+        &&label_jp,
+        &&label_call,
+        &&label_se_vx_kk,
+        &&label_sne_vx_kk,
+        &&label_se_vx_vy,
+        &&label_ld_vx_kk,
+        &&label_add_vx_kk,
+        &&label_ld_vx_vy,
+        &&label_or,
+        &&label_and,
+        &&label_xor,
+        &&label_add_vx_vy,
+        &&label_sub,
+        &&label_shr,
+        &&label_subn,
+        &&label_shl,
+        &&label_sne_vx_vy,
+        &&label_ld_i,
+        &&label_jp_v0,
+        &&label_rnd,
+        &&label_drw,
+        &&label_skp,
+        &&label_sknp,
+        &&label_ld_vx_dt,
+        &&label_ld_vx_k,
+        &&label_ld_dt_vx,
+        &&label_ld_st_vx,
+        &&label_add_i_vx,
+        &&label_ld_f_vx,
+        &&label_ld_b_vx,
+        &&label_ld_i_vx,
+        &&label_ld_vx_i,
+        &&label_scd,
+        &&label_scr,
+        &&label_scl,
+        &&label_exit,
+        &&label_low,
+        &&label_high,
+        &&label_ld_hf_vx,
+        &&label_ld_r_vx,
+        &&label_ld_vx_r,
+        &&label_nop,
+        &&label_unknown,
+    };
+
+    Decoded_instruction *inst;
+
+#define DISPATCH()                                      \
+    if (executed == count) return executed - skipped;   \
+    inst = fetch_decoded(state);                        \
+    state->pc += 2;                                     \
+    executed++;                                         \
+    goto *labels[inst->op]
+
+#define NEXT()                                          \
+    DISPATCH()
+
+    DISPATCH();
+
+    label_cls: op_cls(state, inst); NEXT();
+    label_ret: op_ret(state, inst); NEXT();
+    label_jp: {
+        state->pc -= 2;
+        u32 ran = run_idle_loop(state, inst, count - executed + 1, &skipped);
+        if (ran) {
+            executed += ran - 1;
+            NEXT();
+        }
+
+        state->pc += 2;
+        op_jp(state, inst);
+    } NEXT();
+    label_call: op_call(state, inst); NEXT();
+    label_se_vx_kk: op_se_vx_kk(state, inst); NEXT();
+    label_sne_vx_kk: op_sne_vx_kk(state, inst); NEXT();
+    label_se_vx_vy: op_se_vx_vy(state, inst); NEXT();
+    label_ld_vx_kk: op_ld_vx_kk(state, inst); NEXT();
+    label_add_vx_kk: op_add_vx_kk(state, inst); NEXT();
+    label_ld_vx_vy: op_ld_vx_vy(state, inst); NEXT();
+    label_or: op_or(state, inst); NEXT();
+    label_and: op_and(state, inst); NEXT();
+    label_xor: op_xor(state, inst); NEXT();
+    label_add_vx_vy: op_add_vx_vy(state, inst); NEXT();
+    label_sub: op_sub(state, inst); NEXT();
+    label_shr: op_shr(state, inst); NEXT();
+    label_subn: op_subn(state, inst); NEXT();
+    label_shl: op_shl(state, inst); NEXT();
+    label_sne_vx_vy: op_sne_vx_vy(state, inst); NEXT();
+    label_ld_i: op_ld_i(state, inst); NEXT();
+    label_jp_v0: op_jp_v0(state, inst); NEXT();
+    label_rnd: op_rnd(state, inst); NEXT();
+    label_drw: op_drw(state, inst); NEXT();
+    label_skp: op_skp(state, inst); NEXT();
+    label_sknp: op_sknp(state, inst); NEXT();
+    label_ld_vx_dt: op_ld_vx_dt(state, inst); NEXT();
+    label_ld_vx_k: {
+        op_ld_vx_k(state, inst);
+        if (state->waiting_key) {
+            return executed - skipped;
+        }
+    } NEXT();
+    label_ld_dt_vx: op_ld_dt_vx(state, inst); NEXT();
+    label_ld_st_vx: op_ld_st_vx(state, inst); NEXT();
+    label_add_i_vx: op_add_i_vx(state, inst); NEXT();
+    label_ld_f_vx: op_ld_f_vx(state, inst); NEXT();
+    label_ld_b_vx: op_ld_b_vx(state, inst); NEXT();
+    label_ld_i_vx: op_ld_i_vx(state, inst); NEXT();
+    label_ld_vx_i: op_ld_vx_i(state, inst); NEXT();
+    label_scd: op_scd(state, inst); NEXT();
+    label_scr: op_scr(state, inst); NEXT();
+    label_scl: op_scl(state, inst); NEXT();
+    label_exit: {
+        op_exit(state, inst);
+        return executed - skipped;
+    }
+    label_low: op_low(state, inst); NEXT();
+    label_high: op_high(state, inst); NEXT();
+    label_ld_hf_vx: op_ld_hf_vx(state, inst); NEXT();
+    label_ld_r_vx: op_ld_r_vx(state, inst); NEXT();
+    label_ld_vx_r: op_ld_vx_r(state, inst); NEXT();
+    label_nop: op_nop(state, inst); NEXT();
+    label_unknown: {
+        op_unknown(state, inst);
+        return executed - skipped;
+    }
+
+#undef NEXT
+#undef DISPATCH
+#else
+    while (executed < count) {
+        Decoded_instruction *inst = fetch_decoded(state);
+        if (inst->op == OP_JP) {
+            u32 ran = run_idle_loop(state, inst, count - executed, &skipped);
+            if (ran) {
+                executed += ran;
+                continue;
+            }
+        }
+
+        state->pc += 2;
+        executed++;
+
+        op_handlers[inst->op](state, inst);
+
+        if (stopped_on(state, inst->op)) {
+            break;
+        }
+    }
+
+    return executed - skipped;
+#endif
+}
+
+// Runs count instructions with the dispatch strategy selected at build time.
+// Returns how many were executed, not counting those skipped.
+static u32 run_instructions(Chip8_state *state, u32 count)
+{
+#ifdef CHIP8_THREADED_DISPATCH
+    return emulate_threaded(state, count);
+#else
+    u32 i = 0; // Executed or skipped.
+    u32 skipped = 0;
+    while (i < count) {
+        Decoded_instruction *inst = fetch_decoded(state);
+        if (inst->op == OP_JP) {
+            u32 ran = run_idle_loop(state, inst, count - i, &skipped);
+            if (ran) {
+                i += ran;
+                continue;
+            }
+        }
+
+        emulate(state);
+        i++;
+
+        if (stopped_on(state, inst->op)) {
+            break;
+        }
+    }
+
+    return i - skipped;
+#endif
+}
+
+#include "chip8_jit.cpp"
+
+#ifdef CHIP8_AOT
+#include CHIP8_AOT
+#endif
+
+#include "chip8_rewind.cpp"
+#include "chip8_movie.cpp"
+#include "chip8_profile.cpp"
+
+void seed_chip8(Chip8_state *state, u32 seed)
+{
+    state->random_state = seed ? seed : RANDOM_SEED; // xorshift32 never leaves 0.
+}
+
+u32 run_chip8(Chip8_state *state, u32 count)
+{
+    state->cycles += count;
+    state->idle = 0;
+
+    // Exited or halted: only a reset gets it going again.
+    if (state->exited || state->error) {
+        state->idle = 1;
+        return 0;
+    }
+
+    if (state->waiting_key) {
+        if (!state->keys) {
+            state->idle = 1;
+            return 0;
+        }
+
+        state->waiting_key = 0;
+    }
+
+#if defined(CHIP8_PROFILE)
+    return run_profiled(state, count);
+#elif defined(CHIP8_AOT)
+    return aot_run(state, count);
+#elif defined(CHIP8_JIT)
+    return jit_run(state->jit, state, count);
+#else
+    return run_instructions(state, count);
+#endif
+}
+
+void end_chip8_frame(Chip8_state *state)
+{
+    tick_timers(state);
+
+    Chip8_io *io = state->io;
+    if (io && io->set_sound) {
+        io->set_sound(io->user_data, get_sound_timer(state) > 0);
+    }
+
+    if (state->screen_dirty) {
+        if (io && io->draw_screen) {
+            io->draw_screen(io->user_data, state);
+        }
+
+        state->screen_dirty = 0;
+        state->dirty_rows = 0;
+    }
+}
+
+u32 skip_chip8_frames(Chip8_state *state, u32 frames, u32 count)
+{
+    if (!(state->exited || (state->waiting_key && !state->keys)) || frames == 0) {
+        return 0;
+    }
+
+    // Nothing runs, so the frames only move the clocks, and the screen can only
+    // change on the first.
+    state->cycles += (u64)frames * count;
+    state->idle = 1;
+    state->ticks += frames - 1;
+    end_chip8_frame(state);
+
+    return frames;
+}
+
+u64 hash_chip8(Chip8_state *state)
+{
+    u64 hash = 14695981039346656037ull;
+
+#define HASH(data, size)                                        \
+    for (u32 i = 0; i < (u32)(size); i++) {                     \
+        hash = (hash ^ ((u8 *)(data))[i]) * 1099511628211ull;   \
+    }
+
+    u8 delay_timer = get_delay_timer(state);
+    u8 sound_timer = get_sound_timer(state);
+
+    HASH(state->V, sizeof(state->V));
+    HASH(&state->I, sizeof(state->I));
+    HASH(state->stack, sizeof(state->stack));
+    HASH(&state->sp, sizeof(state->sp));
+    HASH(&state->pc, sizeof(state->pc));
+    HASH(&delay_timer, 1);
+    HASH(&sound_timer, 1);
+    HASH(state->memory, sizeof(state->memory));
+    HASH(state->screen, sizeof(state->screen));
+    HASH(&state->hires, sizeof(state->hires));
+    HASH(state->rpl, sizeof(state->rpl));
+
+#undef HASH
+
+    return hash;
+}
+
+void save_chip8(Chip8_state *state, Chip8_snapshot *snapshot)
+{
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->rom_hash = state->rom_hash;
+
+    snapshot->cycles = state->cycles;
+    memcpy(snapshot->screen, state->screen, sizeof(snapshot->screen));
+    snapshot->delay_timer_tick = state->delay_timer_tick;
+    snapshot->sound_timer_tick = state->sound_timer_tick;
+    snapshot->ticks = state->ticks;
+    snapshot->random_state = state->random_state;
+    snapshot->I = state->I;
+    snapshot->pc = state->pc;
+    memcpy(snapshot->stack, state->stack, sizeof(snapshot->stack));
+    memcpy(snapshot->V, state->V, sizeof(snapshot->V));
+    snapshot->sp = state->sp;
+    snapshot->delay_timer = state->delay_timer;
+    snapshot->sound_timer = state->sound_timer;
+    snapshot->error = state->error;
+    memcpy(snapshot->rpl, state->rpl, sizeof(snapshot->rpl));
+    snapshot->hires = state->hires;
+    memset(snapshot->unused, 0, sizeof(snapshot->unused));
+    memcpy(snapshot->memory, state->memory, sizeof(snapshot->memory));
+}
+
+int restore_chip8(Chip8_state *state, Chip8_snapshot *snapshot)
+{
+    if (snapshot->magic != SNAPSHOT_MAGIC || snapshot->version != SNAPSHOT_VERSION) {
+        return SNAPSHOT_FILE_ERROR;
+    }
+    if (snapshot->rom_hash != state->rom_hash) {
+        return SNAPSHOT_MISMATCH;
+    }
+
+    // Only the bytes that differ drop their decoding, and compiled code if they hold some.
+    for (int i = 0; i < MAX_MEMORY_SIZE; i++) {
+        if (state->memory[i] != snapshot->memory[i]) {
+            state->memory[i] = snapshot->memory[i];
+            invalidate_decoded(state, (u16)i, 1);
+            if (state->jit) {
+                jit_invalidate(state->jit, (u16)i, 1);
+            }
+        }
+    }
+
+    state->cycles = snapshot->cycles;
+    memcpy(state->screen, snapshot->screen, sizeof(state->screen));
+    state->delay_timer_tick = snapshot->delay_timer_tick;
+    state->sound_timer_tick = snapshot->sound_timer_tick;
+    state->ticks = snapshot->ticks;
+    state->random_state = snapshot->random_state;
+    state->I = snapshot->I;
+    state->pc = snapshot->pc;
+    memcpy(state->stack, snapshot->stack, sizeof(state->stack));
+    memcpy(state->V, snapshot->V, sizeof(state->V));
+    state->sp = (u8)(snapshot->sp & (STACK_DEPTH - 1));
+    state->delay_timer = snapshot->delay_timer;
+    state->sound_timer = snapshot->sound_timer;
+    state->error = snapshot->error;
+    memcpy(state->rpl, snapshot->rpl, sizeof(state->rpl));
+    state->hires = snapshot->hires;
+    state->waiting_key = 0; // Fx0A parks again if that is where it was.
+    state->exited = 0; // And 00FD exits again.
+
+    mark_rows_dirty(state, ~(u64)0);
+
+    return 0;
+}
+
+int write_snapshot(Chip8_snapshot *snapshot, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        return SNAPSHOT_FILE_ERROR;
+    }
+
+    size_t written = fwrite(snapshot, sizeof(*snapshot), 1, file);
+    fclose(file);
+
+    return (written == 1) ? 0 : SNAPSHOT_FILE_ERROR;
+}
+
+int read_snapshot(Chip8_snapshot *snapshot, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return SNAPSHOT_FILE_ERROR;
+    }
+
+    size_t read = fread(snapshot, sizeof(*snapshot), 1, file);
+    fclose(file);
+
+    if (read != 1 || snapshot->magic != SNAPSHOT_MAGIC || snapshot->version != SNAPSHOT_VERSION) {
+        memset(snapshot, 0, sizeof(*snapshot));
+        return SNAPSHOT_FILE_ERROR;
+    }
+
+    return 0;
+}
+
+void load_chip8(Chip8_state *state, const u8 *rom, u32 size, Chip8_io *io)
+{
+    Chip8_jit *jit = state->jit; // Kept across resets.
+    Chip8_profile *profile = state->profile;
+
+    memset(state, 0, sizeof(*state));
+    state->io = io;
+    state->jit = jit;
+    state->profile = profile;
+    state->random_state = RANDOM_SEED;
+    clear_screen(state);
+
+    // Load fonts into memory
+    for (int i = 0; i < FONTS_MEMORY_SIZE; i++) {
+        state->memory[i] = fonts[i];
+    }
+    memcpy(state->memory + BIG_FONTS_ADDRESS, big_fonts, sizeof(big_fonts));
+
+    if (size > MAX_MEMORY_SIZE - START_MEMORY) {
+        size = MAX_MEMORY_SIZE - START_MEMORY;
+    }
+    memcpy(state->memory + START_MEMORY, rom, size);
+
+    state->rom_hash = 14695981039346656037ull;
+    for (u32 i = 0; i < size; i++) {
+        state->rom_hash = (state->rom_hash ^ rom[i]) * 1099511628211ull;
+    }
+
+    state->pc = START_MEMORY;
+    state->sp = 0;
+
+#ifdef CHIP8_JIT
+    if (state->jit) {
+        jit_flush(state->jit);
+    } else {
+        state->jit = (Chip8_jit *)malloc(sizeof(Chip8_jit));
+        jit_init(state->jit);
+    }
+#endif
+
+#ifdef CHIP8_PROFILE
+    if (state->profile) {
+        memset(state->profile, 0, sizeof(Chip8_profile));
+    } else {
+        state->profile = (Chip8_profile *)calloc(1, sizeof(Chip8_profile));
+    }
+#endif
+}
+
+int init_chip8(Chip8_state *state, const char *filename_rom, Chip8_io *io)
+{
+    FILE *rom = fopen(filename_rom, "rb");
+    if (!rom) {
+        return ROM_DOES_NOT_EXISTS;
+    }
+
+    u8 data[MAX_MEMORY_SIZE - START_MEMORY];
+    u32 size = (u32)fread(data, 1, sizeof(data), rom);
+    fclose(rom);
+
+    load_chip8(state, data, size, io);
+
+    return 0;
+}
+
+void free_chip8(Chip8_state *state)
+{
+    if (state->jit) {
+        jit_free(state->jit);
+        free(state->jit);
+        state->jit = 0;
+    }
+
+    free(state->profile);
+    state->profile = 0;
+}
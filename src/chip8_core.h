@@ -0,0 +1,335 @@
+#ifndef CHIP8_CORE_H
+#define CHIP8_CORE_H
+
+/*
+CHIP-8 and SUPER-CHIP 1.1 emulation core (libchip8).
+
+Everything needed to run a ROM without a window: the machine state, the interpreter and
+its JIT/AOT backends, and the 60 Hz frame logic. It doesn't depend on raylib; a frontend
+hooks in through the Chip8_io callbacks.
+*/
+
+#include "types.h"
+#include "chip8_decode.h"
+
+// The SUPER-CHIP high resolution screen. CHIP-8 and SUPER-CHIP low resolution use its
+// top-left LORES_WIDTH x LORES_HEIGHT corner.
+#define SCREEN_WIDTH            (128)
+#define SCREEN_HEIGHT           (64)
+#define SCREEN_SIZE             (SCREEN_WIDTH*SCREEN_HEIGHT)
+#define SCREEN_ROW_WORDS        (SCREEN_WIDTH/64)
+#define LORES_WIDTH             (64)
+#define LORES_HEIGHT            (32)
+
+#define UNKNOWN_OPCODE          2
+#define ROM_DOES_NOT_EXISTS     3
+#define SNAPSHOT_FILE_ERROR     5   /* Can't read or write the file, or it isn't a snapshot of this version */
+#define SNAPSHOT_MISMATCH       6   /* Snapshot of another ROM */
+#define MOVIE_FILE_ERROR        7   /* Can't read or write the file, or it isn't a movie of this version */
+#define MOVIE_MISMATCH          8   /* Movie of another ROM */
+#define PROFILE_ERROR           9   /* Can't write the report, or the core wasn't built with CHIP8_PROFILE */
+
+#define MAX_MEMORY_SIZE         (4096)  /* 4 KB */
+#define START_MEMORY            (0x200) /* First 512 are reserved */
+#define MEMORY_ADDRESS(address) ((address) & (MAX_MEMORY_SIZE - 1)) /* Addresses wrap around at 4 KB */
+
+#define KEY_NUMBER              16
+#define STACK_DEPTH             16
+#define RPL_FLAG_COUNT          8       /* SUPER-CHIP Fx75/Fx85 user flags */
+
+struct Chip8_state;
+struct Chip8_jit;
+struct Chip8_profile;
+
+// Callbacks through which the core reaches the frontend. Any of them can be null.
+// Input goes the other way, through state->keys.
+struct Chip8_io {
+    void *user_data;
+
+    // Called once per frame with whether the sound timer is running.
+    void (*set_sound)(void *user_data, int on);
+
+    // Called at the end of a frame in which the screen changed. state->dirty_rows tells which rows.
+    void (*draw_screen)(void *user_data, Chip8_state *state);
+};
+
+struct Chip8_state {
+    u8 V[16]; // 16 8-bit registers, from V0 to VF.
+
+    u16 I; // Address register.
+    u16 stack[STACK_DEPTH];
+
+    // Stack pointer. Calls and returns wrap it around at STACK_DEPTH, as some ROMs
+    // (INVADERS) leave subroutines without returning.
+    u8 sp;
+    u16 pc; // Program counter.
+
+    // Keypad, bit k set while key k is held down. Whatever the input comes from, it is
+    // set between run_chip8() calls, once per frame, never while instructions run.
+    u16 keys;
+
+    /*
+    The timers count down at 60 Hz whatever the instruction rate. Rather than being
+    decremented on every tick, they keep the value and the tick they were set at, and
+    their current value is computed when read.
+    */
+    u8 delay_timer; // Delay timer, as last set.
+    u8 sound_timer; // Sound timer, as last set.
+    u32 delay_timer_tick; // Tick at which the delay timer was set.
+    u32 sound_timer_tick; // Tick at which the sound timer was set.
+    u32 ticks; // 60 Hz ticks since start.
+
+    u32 random_state; // xorshift32 state for Cxkk, per instance. See seed_chip8().
+
+    u64 cycles; // Instructions given to run_chip8() since reset, executed or not.
+    u64 draws; // Dxyn run since reset. A statistic, not saved in snapshots.
+
+    u8 error; // UNKNOWN_OPCODE once halted on an unknown opcode, when run_chip8() runs nothing, 0 otherwise.
+    u8 idle; // Set when the last run_chip8() was left spinning in a loop only the next frame can end.
+    u8 waiting_key; // Parked on Fx0A: run_chip8() runs nothing until keys has a key.
+    u8 exited; // Ran 00FD: run_chip8() runs nothing until a reset.
+
+    u8 memory[MAX_MEMORY_SIZE];
+
+    // SCREEN_ROW_WORDS words per row, the most significant bit of the first being the
+    // leftmost pixel (x = 0), so that a row shifts as one 128-bit value.
+    u64 screen[SCREEN_HEIGHT][SCREEN_ROW_WORDS];
+    u8 hires; // 128x64 after 00FF, 64x32 after 00FE and at reset.
+
+    // Set by every instruction that draws, cleared at the end of every frame.
+    u8 screen_dirty;
+    u64 dirty_rows; // Bit y set when screen row y changed.
+
+    u8 rpl[RPL_FLAG_COUNT]; // SUPER-CHIP user flags (the HP-48 RPL registers).
+
+    // Decode cache indexed by PC. It mirrors memory, so every write to memory must
+    // invalidate the entries that overlap the written bytes.
+    Decoded_instruction decoded[MAX_MEMORY_SIZE];
+
+    Chip8_io *io;
+    Chip8_jit *jit; // Compiled code of this instance, with CHIP8_JIT.
+    Chip8_profile *profile; // Execution counts of this instance, with CHIP8_PROFILE.
+
+    u64 rom_hash; // FNV-1a hash of the ROM loaded, to match snapshots.
+};
+
+#define SNAPSHOT_MAGIC          (0x4E533843) /* "C8SN" */
+#define SNAPSHOT_VERSION        (3)
+
+/*
+Saved machine state. Snapshot files hold it as is, little-endian: the header (magic,
+version and hash of the ROM), then the machine. The fields are ordered so that there is
+no padding, and it can be copied, compared or XORed as raw bytes. Bump SNAPSHOT_VERSION
+on any change.
+*/
+struct Chip8_snapshot {
+    u32 magic;
+    u32 version;
+    u64 rom_hash;
+
+    u64 cycles;
+    u64 screen[SCREEN_HEIGHT][SCREEN_ROW_WORDS];
+
+    u32 delay_timer_tick;
+    u32 sound_timer_tick;
+    u32 ticks;
+    u32 random_state;
+
+    u16 I;
+    u16 pc;
+    u16 stack[STACK_DEPTH];
+
+    u8 V[16];
+    u8 sp;
+    u8 delay_timer;
+    u8 sound_timer;
+    u8 error;
+    u8 rpl[RPL_FLAG_COUNT];
+    u8 hires;
+    u8 unused[7]; // Keeps memory 8-byte aligned.
+
+    u8 memory[MAX_MEMORY_SIZE];
+};
+
+// Value of a timer set to value at tick set_tick.
+static inline u8 timer_value(Chip8_state *state, u8 value, u32 set_tick)
+{
+    u32 elapsed = state->ticks - set_tick;
+
+    return (elapsed >= value) ? 0 : (u8)(value - elapsed);
+}
+
+static inline u8 get_delay_timer(Chip8_state *state)
+{
+    return timer_value(state, state->delay_timer, state->delay_timer_tick);
+}
+
+static inline u8 get_sound_timer(Chip8_state *state)
+{
+    return timer_value(state, state->sound_timer, state->sound_timer_tick);
+}
+
+// Size of the screen in the current resolution.
+static inline int get_screen_width(Chip8_state *state)
+{
+    return state->hires ? SCREEN_WIDTH : LORES_WIDTH;
+}
+
+static inline int get_screen_height(Chip8_state *state)
+{
+    return state->hires ? SCREEN_HEIGHT : LORES_HEIGHT;
+}
+
+static inline u8 get_pixel(Chip8_state *state, int x, int y)
+{
+    return (u8)((state->screen[y][x / 64] >> (63 - x % 64)) & 1);
+}
+
+/*
+Resets the machine and loads the ROM. io can be null. Returns 0 or ROM_DOES_NOT_EXISTS.
+The state must be zeroed before the first call. Instances share nothing, so each can
+run on its own thread.
+*/
+int init_chip8(Chip8_state *state, const char *filename_rom, Chip8_io *io);
+
+// init_chip8() with the ROM already in memory, size bytes of it.
+void load_chip8(Chip8_state *state, const u8 *rom, u32 size, Chip8_io *io);
+
+// Releases what init_chip8() allocated.
+void free_chip8(Chip8_state *state);
+
+// Seeds the PRNG of Cxkk. init_chip8() seeds every instance the same; 0 picks that seed.
+void seed_chip8(Chip8_state *state, u32 seed);
+
+// Runs count instructions with the backend selected at build time. Returns how many were
+// executed: fewer than count when idle loops were skipped, or the machine parked on Fx0A,
+// exited or halted.
+u32 run_chip8(Chip8_state *state, u32 count);
+
+// Ends a 60 Hz frame: ticks the timers, then reports the sound and the screen changes to io.
+void end_chip8_frame(Chip8_state *state);
+
+// Moves a machine parked on Fx0A with no key held, or exited, through frames frames of
+// count instructions, as run_chip8() and end_chip8_frame() would, but in one go. Returns
+// the frames skipped: frames, or 0 when the machine would run.
+u32 skip_chip8_frames(Chip8_state *state, u32 frames, u32 count);
+
+// FNV-1a hash of the machine state (registers, timers, memory, screen and flags).
+u64 hash_chip8(Chip8_state *state);
+
+// Saves the machine into a preallocated snapshot.
+void save_chip8(Chip8_state *state, Chip8_snapshot *snapshot);
+
+// Puts the machine back as saved. Returns 0, SNAPSHOT_FILE_ERROR for an empty or invalid
+// snapshot, or SNAPSHOT_MISMATCH if it was taken with another ROM.
+int restore_chip8(Chip8_state *state, Chip8_snapshot *snapshot);
+
+// Snapshot files. Both return 0 or SNAPSHOT_FILE_ERROR.
+int write_snapshot(Chip8_snapshot *snapshot, const char *filename);
+int read_snapshot(Chip8_snapshot *snapshot, const char *filename);
+
+/*
+Profile, in builds with CHIP8_PROFILE: every instance counts the instructions it runs by
+opcode and by PC since its last reset (init_chip8() or load_chip8()), and the host
+timestamp counter ticks spent running them and in Dxyn. It runs on the switch interpreter, whatever the
+backend selected.
+*/
+struct Chip8_profile {
+    u64 op_counts[OP_COUNT]; // By Op_kind.
+    u64 pc_counts[MAX_MEMORY_SIZE];
+
+    u64 ticks;
+    u64 drw_ticks;
+};
+
+// Writes the profile as JSON if filename ends with ".json", as a report sorted by count
+// otherwise. Returns 0 or PROFILE_ERROR.
+int write_profile(Chip8_state *state, const char *filename);
+
+/*
+Rewind buffer: push_rewind() once per frame records the machine, and pop_rewind() goes
+back one frame at a time, up to depth frames. Frames are stored as run-length encoded
+XOR deltas of their snapshots, in a ring of buffer_size bytes that drops the oldest
+frames when full, so the memory used is fixed at init_rewind().
+*/
+struct Rewind_entry;
+
+struct Chip8_rewind {
+    u32 depth; // Frames it can go back, at most.
+
+    Rewind_entry *entries; // Ring of depth deltas, oldest at first.
+    u32 first;
+    u32 count;
+
+    // Byte ring holding the deltas.
+    u8 *buffer;
+    u32 buffer_size;
+    u32 head; // Where the next delta goes.
+    u32 wrap_end; // End of the deltas before the start of the ring, when wrapped.
+    u8 wrapped;
+
+    Chip8_snapshot *snapshots; // The latest pushed, and room for the next one.
+    u8 latest;
+    u8 has_latest;
+    u8 *scratch;
+};
+
+void init_rewind(Chip8_rewind *rewind, u32 depth, u32 buffer_size);
+void free_rewind(Chip8_rewind *rewind);
+
+// Records the machine as the newest frame.
+void push_rewind(Chip8_rewind *rewind, Chip8_state *state);
+
+// Puts the machine back to the frame before the newest, and drops the newest.
+// Returns 0, changing nothing, when there is no frame left to go back to.
+int pop_rewind(Chip8_rewind *rewind, Chip8_state *state);
+
+// Bytes used by the deltas.
+u32 get_rewind_bytes(Chip8_rewind *rewind);
+
+/*
+Movies: the keys held during a run, to replay it exactly. With the seed and the
+instructions per frame, the keypad bitmask (bit k for key k) is stored only when it
+changes, along with the cycle at which it did.
+
+Files are little-endian: "C8MV", the version, the ROM hash, the seed, the instructions
+per frame, the length in cycles and the event count, all fixed size, then per event the
+cycles since the previous event as a LEB128 varint and the keys as a u16.
+*/
+#define MOVIE_MAGIC             (0x564D3843) /* "C8MV" */
+#define MOVIE_VERSION           (2)
+
+struct Movie_event {
+    u64 cycle;
+    u16 keys;
+};
+
+struct Chip8_movie {
+    u64 rom_hash;
+    u32 seed;
+    u32 cycles_per_frame;
+    u64 length; // Cycles.
+
+    Movie_event *events;
+    u32 count;
+    u32 capacity;
+
+    u32 next; // Next event to play.
+};
+
+// Starts recording a run of state, which must have just been reset and seeded with seed.
+void start_movie(Chip8_movie *movie, Chip8_state *state, u32 seed, u32 cycles_per_frame);
+
+// Records state->keys as held from now on. Call it before every frame.
+void record_movie(Chip8_movie *movie, Chip8_state *state);
+
+// Sets state->keys to the keys held at the current cycle of state, replaying from the start.
+void play_movie(Chip8_movie *movie, Chip8_state *state);
+
+// write_movie() takes the length from state. Both return 0 or MOVIE_FILE_ERROR.
+int write_movie(Chip8_movie *movie, Chip8_state *state, const char *filename);
+int read_movie(Chip8_movie *movie, const char *filename);
+
+void free_movie(Chip8_movie *movie);
+
+#endif
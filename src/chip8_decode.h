@@ -0,0 +1,167 @@
+#ifndef CHIP8_DECODE_H
+#define CHIP8_DECODE_H
+
+#include "types.h"
+
+/*
+Decoded form of an instruction. Decoding is done once per address and cached, so
+the interpreter doesn't have to fetch and pick apart the opcode on every cycle.
+*/
+enum Op_kind {
+    OP_NONE = 0,    // Not decoded yet.
+    OP_CLS,         // 00E0
+    OP_RET,         // 00EE
+    OP_JP,          // 1nnn
+    OP_CALL,        // 2nnn
+    OP_SE_VX_KK,    // 3xkk
+    OP_SNE_VX_KK,   // 4xkk
+    OP_SE_VX_VY,    // 5xy0
+    OP_LD_VX_KK,    // 6xkk
+    OP_ADD_VX_KK,   // 7xkk
+    OP_LD_VX_VY,    // 8xy0
+    OP_OR,          // 8xy1
+    OP_AND,         // 8xy2
+    OP_XOR,         // 8xy3
+    OP_ADD_VX_VY,   // 8xy4
+    OP_SUB,         // 8xy5
+    OP_SHR,         // 8xy6
+    OP_SUBN,        // 8xy7
+    OP_SHL,         // 8xyE
+    OP_SNE_VX_VY,   // 9xy0
+    OP_LD_I,        // Annn
+    OP_JP_V0,       // Bnnn
+    OP_RND,         // Cxkk
+    OP_DRW,         // Dxyn
+    OP_SKP,         // Ex9E
+    OP_SKNP,        // ExA1
+    OP_LD_VX_DT,    // Fx07
+    OP_LD_VX_K,     // Fx0A
+    OP_LD_DT_VX,    // Fx15
+    OP_LD_ST_VX,    // Fx18
+    OP_ADD_I_VX,    // Fx1E
+    OP_LD_F_VX,     // Fx29
+    OP_LD_B_VX,     // Fx33
+    OP_LD_I_VX,     // Fx55
+    OP_LD_VX_I,     // Fx65
+    OP_SCD,         // 00Cn, SUPER-CHIP from here on
+    OP_SCR,         // 00FB
+    OP_SCL,         // 00FC
+    OP_EXIT,        // 00FD
+    OP_LOW,         // 00FE
+    OP_HIGH,        // 00FF
+    OP_LD_HF_VX,    // Fx30
+    OP_LD_R_VX,     // Fx75
+    OP_LD_VX_R,     // Fx85
+    OP_NOP,         // Unassigned opcodes inside a known group, which are ignored.
+    OP_UNKNOWN,
+
+    OP_COUNT
+};
+
+struct Decoded_instruction {
+    u8 op; // Op_kind
+    u8 x;
+    u8 y;
+    u8 n;
+    u8 kk;
+    u16 nnn;
+};
+
+static inline void decode_instruction(u16 opcode, Decoded_instruction *inst)
+{
+    inst->x = (opcode & 0xF00) >> 8;
+    inst->y = (opcode & 0xF0) >> 4;
+    inst->n = opcode & 0xF;
+    inst->kk = opcode & 0xFF;
+    inst->nnn = opcode & 0xFFF;
+
+    switch (opcode & 0xF000) {
+        case 0x1000: inst->op = OP_JP; break;
+        case 0x2000: inst->op = OP_CALL; break;
+        case 0x3000: inst->op = OP_SE_VX_KK; break;
+        case 0x4000: inst->op = OP_SNE_VX_KK; break;
+        case 0x5000: inst->op = OP_SE_VX_VY; break;
+        case 0x6000: inst->op = OP_LD_VX_KK; break;
+        case 0x7000: inst->op = OP_ADD_VX_KK; break;
+
+        case 0x8000: {
+            switch (opcode & 0xF) {
+                case 0x0: inst->op = OP_LD_VX_VY; break;
+                case 0x1: inst->op = OP_OR; break;
+                case 0x2: inst->op = OP_AND; break;
+                case 0x3: inst->op = OP_XOR; break;
+                case 0x4: inst->op = OP_ADD_VX_VY; break;
+                case 0x5: inst->op = OP_SUB; break;
+                case 0x6: inst->op = OP_SHR; break;
+                case 0x7: inst->op = OP_SUBN; break;
+                case 0xE: inst->op = OP_SHL; break;
+                default:  inst->op = OP_NOP; break;
+            }
+        } break;
+
+        case 0x9000: inst->op = OP_SNE_VX_VY; break;
+        case 0xA000: inst->op = OP_LD_I; break;
+        case 0xB000: inst->op = OP_JP_V0; break;
+        case 0xC000: inst->op = OP_RND; break;
+        case 0xD000: inst->op = OP_DRW; break;
+
+        case 0xE000: {
+            switch (opcode & 0xFF) {
+                case 0x9E: inst->op = OP_SKP; break;
+                case 0xA1: inst->op = OP_SKNP; break;
+                default:   inst->op = OP_NOP; break;
+            }
+        } break;
+
+        case 0xF000: {
+            switch (opcode & 0xFF) {
+                case 0x07: inst->op = OP_LD_VX_DT; break;
+                case 0x0A: inst->op = OP_LD_VX_K; break;
+                case 0x15: inst->op = OP_LD_DT_VX; break;
+                case 0x18: inst->op = OP_LD_ST_VX; break;
+                case 0x1E: inst->op = OP_ADD_I_VX; break;
+                case 0x29: inst->op = OP_LD_F_VX; break;
+                case 0x33: inst->op = OP_LD_B_VX; break;
+                case 0x55: inst->op = OP_LD_I_VX; break;
+                case 0x65: inst->op = OP_LD_VX_I; break;
+                case 0x30: inst->op = OP_LD_HF_VX; break;
+                case 0x75: inst->op = OP_LD_R_VX; break;
+                case 0x85: inst->op = OP_LD_VX_R; break;
+                default:   inst->op = OP_NOP; break;
+            }
+        } break;
+
+        default: {
+            switch (opcode & 0xFF) {
+                case 0xEE: inst->op = OP_RET; break;
+                case 0xE0: inst->op = OP_CLS; break;
+                case 0xFB: inst->op = OP_SCR; break;
+                case 0xFC: inst->op = OP_SCL; break;
+                case 0xFD: inst->op = OP_EXIT; break;
+                case 0xFE: inst->op = OP_LOW; break;
+                case 0xFF: inst->op = OP_HIGH; break;
+                default:   inst->op = ((opcode & 0xF0) == 0xC0) ? OP_SCD : OP_UNKNOWN; break;
+            }
+        } break;
+    }
+}
+
+// An idle loop is a backward 1nnn over at most IDLE_MAX_BODY instructions, all idle ops.
+#define IDLE_MAX_BODY           8       /* Instructions between the target and the jump */
+
+// Reads registers, memory, the delay timer or the keys, and writes only registers.
+static inline int is_idle_op(u8 op)
+{
+    switch (op) {
+        case OP_SE_VX_KK: case OP_SNE_VX_KK: case OP_SE_VX_VY: case OP_SNE_VX_VY:
+        case OP_LD_VX_KK: case OP_ADD_VX_KK: case OP_LD_VX_VY: case OP_OR: case OP_AND:
+        case OP_XOR: case OP_ADD_VX_VY: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL:
+        case OP_LD_I: case OP_SKP: case OP_SKNP: case OP_LD_VX_DT: case OP_ADD_I_VX:
+        case OP_LD_F_VX: case OP_LD_VX_I: case OP_LD_HF_VX: case OP_NOP:
+            return 1;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,663 @@
+/*
+x86-64 dynamic recompiler.
+
+Translates CHIP-8 basic blocks into native code and caches them by start PC. A block
+ends at the first jump (1nnn, 2nnn, 00EE, Bnnn), which is compiled as well, or right
+before an instruction the JIT leaves to the interpreter (Dxyn, Ex9E/ExA1, Fx0A, Cxkk,
+00E0, Fx33, Fx55, the SUPER-CHIP screen and flag instructions and unknown opcodes). Skips leave the block when taken, and a 1nnn
+back to the start of its own block loops without going back to jit_run().
+Fx33/Fx55 are the only instructions that write memory, so they are always interpreted
+and flush the cache when they touch compiled code.
+
+Idle loops are skipped as the interpreter does: a block that loops on itself with a
+body of idle instructions runs its first pass alone, to see whether the registers
+change, and a 1nnn reached from jit_run() goes through run_idle_loop().
+
+The generated code works directly on Chip8_state and gives exactly the same results
+as emulate().
+*/
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT_SUPPORTED
+#endif
+
+#ifdef CHIP8_JIT_SUPPORTED
+#ifdef _WIN32
+extern "C" __declspec(dllimport) void * __stdcall VirtualAlloc(void *address, size_t size, unsigned long allocation_type, unsigned long protect);
+extern "C" __declspec(dllimport) int __stdcall VirtualFree(void *address, size_t size, unsigned long free_type);
+#define JIT_MEM_COMMIT_RESERVE          (0x1000 | 0x2000)
+#define JIT_PAGE_EXECUTE_READWRITE      (0x40)
+#define JIT_MEM_RELEASE                 (0x8000)
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#include <stddef.h>
+
+#define JIT_BUFFER_SIZE                 (1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS      64
+#define JIT_MAX_INSTRUCTION_BYTES       512 /* Fx65 with x = F is the largest */
+
+enum Jit_block_status {
+    JIT_BLOCK_NONE = 0,     // Not compiled yet.
+    JIT_BLOCK_COMPILED,
+    JIT_BLOCK_INTERPRET,    // First instruction is left to the interpreter.
+};
+
+struct Jit_block {
+    u8 *code;
+    u8 status; // Jit_block_status
+    u8 idle; // Loops on itself with a body of idle instructions: may be an idle loop.
+    u16 length; // Number of CHIP-8 instructions in one pass through the block.
+};
+
+struct Chip8_jit {
+    u8 *buffer;
+    u32 used;
+
+    Jit_block blocks[MAX_MEMORY_SIZE]; // Indexed by start PC.
+    u8 code_map[MAX_MEMORY_SIZE]; // Non-zero for every memory byte covered by a block.
+};
+
+// Runs at most budget instructions and returns how many were executed.
+typedef u32 (*Jit_block_fn)(Chip8_state *state, u32 budget);
+
+static void jit_flush(Chip8_jit *jit)
+{
+    jit->used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+}
+
+static void jit_init(Chip8_jit *jit)
+{
+#ifdef CHIP8_JIT_SUPPORTED
+#ifdef _WIN32
+    jit->buffer = (u8 *)VirtualAlloc(0, JIT_BUFFER_SIZE, JIT_MEM_COMMIT_RESERVE, JIT_PAGE_EXECUTE_READWRITE);
+#else
+    void *buffer = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->buffer = (buffer == MAP_FAILED) ? 0 : (u8 *)buffer;
+#endif
+#endif
+
+    jit_flush(jit);
+}
+
+static void jit_free(Chip8_jit *jit)
+{
+#ifdef CHIP8_JIT_SUPPORTED
+    if (jit->buffer) {
+#ifdef _WIN32
+        VirtualFree(jit->buffer, 0, JIT_MEM_RELEASE);
+#else
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+#endif
+    }
+#endif
+
+    jit->buffer = 0;
+}
+
+// Must be called after memory[address..address+count-1] was written.
+static void jit_invalidate(Chip8_jit *jit, u16 address, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (jit->code_map[MEMORY_ADDRESS(address + i)]) {
+            jit_flush(jit);
+            return;
+        }
+    }
+}
+
+
+#ifdef CHIP8_JIT_SUPPORTED
+
+// The state pointer stays in the register of the first argument for the whole block.
+// The budget is moved to r8d and the instructions executed by completed loop passes are
+// counted in r9d. Those and rax/rdx are scratch registers in both ABIs.
+#ifdef _WIN32
+#define JIT_BASE        1   // rcx
+#define JIT_BUDGET      2   // edx
+#else
+#define JIT_BASE        7   // rdi
+#define JIT_BUDGET      6   // esi
+#endif
+#define JIT_EAX         0
+#define JIT_EDX         2
+
+#define V_OFFSET(r)     (u32)(offsetof(Chip8_state, V) + (r))
+#define I_OFFSET        (u32)offsetof(Chip8_state, I)
+#define SP_OFFSET       (u32)offsetof(Chip8_state, sp)
+#define PC_OFFSET       (u32)offsetof(Chip8_state, pc)
+#define STACK_OFFSET    (u32)offsetof(Chip8_state, stack)
+#define MEMORY_OFFSET   (u32)offsetof(Chip8_state, memory)
+#define DELAY_OFFSET    (u32)offsetof(Chip8_state, delay_timer)
+#define SOUND_OFFSET    (u32)offsetof(Chip8_state, sound_timer)
+#define DELAY_TICK_OFFSET (u32)offsetof(Chip8_state, delay_timer_tick)
+#define SOUND_TICK_OFFSET (u32)offsetof(Chip8_state, sound_timer_tick)
+#define TICKS_OFFSET    (u32)offsetof(Chip8_state, ticks)
+
+// Opcode extensions of the 0x80 group (op r/m8, imm8).
+#define ALU_ADD         0
+#define ALU_AND         4
+#define ALU_SUB         5
+#define ALU_CMP         7
+
+struct Jit_emitter {
+    u8 *at;
+};
+
+static void emit_u8(Jit_emitter *e, u8 value)
+{
+    *e->at++ = value;
+}
+
+static void emit_u16(Jit_emitter *e, u16 value)
+{
+    emit_u8(e, (u8)value);
+    emit_u8(e, (u8)(value >> 8));
+}
+
+static void emit_u32(Jit_emitter *e, u32 value)
+{
+    emit_u16(e, (u16)value);
+    emit_u16(e, (u16)(value >> 16));
+}
+
+// ModRM for [base + disp32].
+static void emit_mem(Jit_emitter *e, u8 reg, u32 offset)
+{
+    emit_u8(e, (u8)(0x80 | (reg << 3) | JIT_BASE));
+    emit_u32(e, offset);
+}
+
+// ModRM + SIB for [base + index*scale + disp32], scale being 0 (x1) or 1 (x2).
+static void emit_mem_indexed(Jit_emitter *e, u8 reg, u8 index, u8 scale, u32 offset)
+{
+    emit_u8(e, (u8)(0x84 | (reg << 3)));
+    emit_u8(e, (u8)((scale << 6) | (index << 3) | JIT_BASE));
+    emit_u32(e, offset);
+}
+
+// movzx reg, byte [state + offset]
+static void emit_load_byte(Jit_emitter *e, u8 reg, u32 offset)
+{
+    emit_u8(e, 0x0F); emit_u8(e, 0xB6);
+    emit_mem(e, reg, offset);
+}
+
+// mov byte [state + offset], al
+static void emit_store_al(Jit_emitter *e, u32 offset)
+{
+    emit_u8(e, 0x88);
+    emit_mem(e, JIT_EAX, offset);
+}
+
+// mov byte [state + offset], imm8
+static void emit_store_byte_imm(Jit_emitter *e, u32 offset, u8 value)
+{
+    emit_u8(e, 0xC6);
+    emit_mem(e, 0, offset);
+    emit_u8(e, value);
+}
+
+// mov word [state + offset], imm16
+static void emit_store_word_imm(Jit_emitter *e, u32 offset, u16 value)
+{
+    emit_u8(e, 0x66); emit_u8(e, 0xC7);
+    emit_mem(e, 0, offset);
+    emit_u16(e, value);
+}
+
+// <alu> byte [state + offset], imm8
+static void emit_alu_byte_imm(Jit_emitter *e, u8 alu, u32 offset, u8 value)
+{
+    emit_u8(e, 0x80);
+    emit_mem(e, alu, offset);
+    emit_u8(e, value);
+}
+
+// <op> byte [state + offset], al. opcode is the "r/m8, r8" form (ADD 00, OR 08, AND 20, SUB 28, XOR 30).
+static void emit_op_mem_al(Jit_emitter *e, u8 opcode, u32 offset)
+{
+    emit_u8(e, opcode);
+    emit_mem(e, JIT_EAX, offset);
+}
+
+// Stores al = (al <cond> dl) in VF, where setcc is the second byte of the SETcc opcode.
+static void emit_compare_to_vf(Jit_emitter *e, u8 setcc)
+{
+    emit_u8(e, 0x38); emit_u8(e, 0xD0);                 // cmp al, dl
+    emit_u8(e, 0x0F); emit_u8(e, setcc); emit_u8(e, 0xC0); // setcc al
+    emit_store_al(e, V_OFFSET(0xF));
+}
+
+struct Jit_block_context {
+    u16 start;
+    u8 *loop; // Code right after the prologue, where a pass through the block starts.
+};
+
+// Leaves the block, having executed r9d + executed instructions. The PC must be set already.
+static void emit_leave(Jit_emitter *e, u32 executed)
+{
+    emit_u8(e, 0x41); emit_u8(e, 0x8D); emit_u8(e, 0x81); // lea eax, [r9 + executed]
+    emit_u32(e, executed);
+    emit_u8(e, 0xC3);                                     // ret
+}
+
+static void emit_exit(Jit_emitter *e, u16 address, u32 executed)
+{
+    emit_store_word_imm(e, PC_OFFSET, address);
+    emit_leave(e, executed);
+}
+
+/*
+Leaves the block at address + 4 unless the last comparison says the skip is not taken
+(jcc_no_skip is the opcode of the short jcc for that, 0x75 for jne or 0x74 for je).
+Otherwise the block continues with the next instruction.
+*/
+static void emit_skip(Jit_emitter *e, u16 address, u32 executed, u8 jcc_no_skip)
+{
+    emit_u8(e, jcc_no_skip); emit_u8(e, 0);
+    u8 *jump = e->at;
+
+    emit_exit(e, (u16)(address + 4), executed);
+
+    jump[-1] = (u8)(e->at - jump);
+}
+
+/*
+Emits the instruction at address, which is instruction number index (from 0) in the
+block. Returns 1 if it was compiled, 0 if it must be left to the interpreter.
+Sets *ends_block for the jumps, which leave the block by themselves.
+*/
+static int jit_emit_instruction(Jit_emitter *e, Jit_block_context *block, Decoded_instruction *inst, u16 address, u32 index, int *ends_block)
+{
+    u8 x = inst->x;
+    u8 y = inst->y;
+    u32 executed = index + 1;
+
+    *ends_block = 0;
+
+    switch (inst->op) {
+        // Instructions that can't be compiled, so nothing is emitted for them.
+        case OP_CLS:
+        case OP_RND:
+        case OP_DRW:
+        case OP_SKP:
+        case OP_SKNP:
+        case OP_LD_VX_K:
+        case OP_LD_B_VX:
+        case OP_LD_I_VX:
+        case OP_SCD:
+        case OP_SCR:
+        case OP_SCL:
+        case OP_EXIT:
+        case OP_LOW:
+        case OP_HIGH:
+        case OP_LD_R_VX:
+        case OP_LD_VX_R:
+        case OP_UNKNOWN: {
+            return 0;
+        } break;
+    }
+
+    switch (inst->op) {
+        case OP_RET: {
+            emit_alu_byte_imm(e, ALU_SUB, SP_OFFSET, 1);
+            emit_alu_byte_imm(e, ALU_AND, SP_OFFSET, STACK_DEPTH - 1);
+            emit_load_byte(e, JIT_EAX, SP_OFFSET);
+            emit_u8(e, 0x0F); emit_u8(e, 0xB7);             // movzx eax, word [state + rax*2 + stack]
+            emit_mem_indexed(e, JIT_EAX, JIT_EAX, 1, STACK_OFFSET);
+            emit_u8(e, 0x66); emit_u8(e, 0x89);             // mov word [state + pc], ax
+            emit_mem(e, JIT_EAX, PC_OFFSET);
+            emit_leave(e, executed);
+            *ends_block = 1;
+        } break;
+
+        case OP_JP: {
+            if (inst->nnn == block->start) {
+                // Loop back while a whole pass still fits in the budget.
+                emit_u8(e, 0x41); emit_u8(e, 0x81); emit_u8(e, 0xC1); // add r9d, executed
+                emit_u32(e, executed);
+                emit_u8(e, 0x44); emit_u8(e, 0x89); emit_u8(e, 0xC8); // mov eax, r9d
+                emit_u8(e, 0x05); emit_u32(e, executed);            // add eax, executed
+                emit_u8(e, 0x44); emit_u8(e, 0x39); emit_u8(e, 0xC0); // cmp eax, r8d
+                emit_u8(e, 0x0F); emit_u8(e, 0x86);                 // jbe loop
+                emit_u32(e, (u32)(block->loop - (e->at + 4)));
+                emit_exit(e, block->start, 0);
+            } else {
+                emit_exit(e, inst->nnn, executed);
+            }
+            *ends_block = 1;
+        } break;
+
+        case OP_CALL: {
+            emit_load_byte(e, JIT_EAX, SP_OFFSET);
+            emit_u8(e, 0x66); emit_u8(e, 0xC7);             // mov word [state + rax*2 + stack], imm16
+            emit_mem_indexed(e, 0, JIT_EAX, 1, STACK_OFFSET);
+            emit_u16(e, (u16)(address + 2));
+            emit_alu_byte_imm(e, ALU_ADD, SP_OFFSET, 1);
+            emit_alu_byte_imm(e, ALU_AND, SP_OFFSET, STACK_DEPTH - 1);
+            emit_exit(e, inst->nnn, executed);
+            *ends_block = 1;
+        } break;
+
+        case OP_SE_VX_KK:
+        case OP_SNE_VX_KK: {
+            emit_alu_byte_imm(e, ALU_CMP, V_OFFSET(x), inst->kk);
+            emit_skip(e, address, executed, (inst->op == OP_SE_VX_KK) ? 0x75 : 0x74);
+        } break;
+
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0x3A);                               // cmp al, byte [state + Vy]
+            emit_mem(e, JIT_EAX, V_OFFSET(y));
+            emit_skip(e, address, executed, (inst->op == OP_SE_VX_VY) ? 0x75 : 0x74);
+        } break;
+
+        case OP_LD_VX_KK: {
+            emit_store_byte_imm(e, V_OFFSET(x), inst->kk);
+        } break;
+
+        case OP_ADD_VX_KK: {
+            emit_alu_byte_imm(e, ALU_ADD, V_OFFSET(x), inst->kk);
+        } break;
+
+        case OP_LD_VX_VY: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_store_al(e, V_OFFSET(x));
+        } break;
+
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR: {
+            u8 opcode = (inst->op == OP_OR) ? 0x08 : (inst->op == OP_AND) ? 0x20 : 0x30;
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_op_mem_al(e, opcode, V_OFFSET(x));
+        } break;
+
+        case OP_ADD_VX_VY: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_op_mem_al(e, 0x00, V_OFFSET(x));
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_load_byte(e, JIT_EDX, V_OFFSET(y));
+            emit_compare_to_vf(e, 0x92);                    // setb
+        } break;
+
+        case OP_SUB: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_load_byte(e, JIT_EDX, V_OFFSET(y));
+            emit_compare_to_vf(e, 0x93);                    // setae
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_op_mem_al(e, 0x28, V_OFFSET(x));
+        } break;
+
+        case OP_SHR: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0x24); emit_u8(e, 0x01);             // and al, 1
+            emit_store_al(e, V_OFFSET(0xF));
+            emit_u8(e, 0xD0);                               // shr byte [state + Vx], 1
+            emit_mem(e, 5, V_OFFSET(x));
+        } break;
+
+        case OP_SUBN: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_load_byte(e, JIT_EDX, V_OFFSET(x));
+            emit_compare_to_vf(e, 0x93);                    // setae
+            emit_load_byte(e, JIT_EAX, V_OFFSET(y));
+            emit_u8(e, 0x2A);                               // sub al, byte [state + Vx]
+            emit_mem(e, JIT_EAX, V_OFFSET(x));
+            emit_store_al(e, V_OFFSET(x));
+        } break;
+
+        case OP_SHL: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0xC0); emit_u8(e, 0xE8); emit_u8(e, 7); // shr al, 7
+            emit_store_al(e, V_OFFSET(0xF));
+            emit_u8(e, 0xD0);                               // shl byte [state + Vx], 1
+            emit_mem(e, 4, V_OFFSET(x));
+        } break;
+
+        case OP_LD_I: {
+            emit_store_word_imm(e, I_OFFSET, inst->nnn);
+        } break;
+
+        case OP_JP_V0: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(0));
+            emit_u8(e, 0x05); emit_u32(e, inst->nnn);       // add eax, nnn
+            emit_u8(e, 0x66); emit_u8(e, 0x89);             // mov word [state + pc], ax
+            emit_mem(e, JIT_EAX, PC_OFFSET);
+            emit_leave(e, executed);
+            *ends_block = 1;
+        } break;
+
+        case OP_LD_VX_DT: {
+            // Vx = max(delay_timer - (ticks - delay_timer_tick), 0)
+            emit_u8(e, 0x8B); emit_mem(e, JIT_EAX, TICKS_OFFSET);      // mov eax, [state + ticks]
+            emit_u8(e, 0x2B); emit_mem(e, JIT_EAX, DELAY_TICK_OFFSET); // sub eax, [state + delay_timer_tick]
+            emit_load_byte(e, JIT_EDX, DELAY_OFFSET);
+            emit_u8(e, 0x29); emit_u8(e, 0xC2);                 // sub edx, eax
+            emit_u8(e, 0x19); emit_u8(e, 0xC0);                 // sbb eax, eax
+            emit_u8(e, 0xF7); emit_u8(e, 0xD0);                 // not eax
+            emit_u8(e, 0x21); emit_u8(e, 0xD0);                 // and eax, edx
+            emit_store_al(e, V_OFFSET(x));
+        } break;
+
+        case OP_LD_DT_VX:
+        case OP_LD_ST_VX: {
+            u32 timer_offset = (inst->op == OP_LD_DT_VX) ? DELAY_OFFSET : SOUND_OFFSET;
+            u32 tick_offset = (inst->op == OP_LD_DT_VX) ? DELAY_TICK_OFFSET : SOUND_TICK_OFFSET;
+
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_store_al(e, timer_offset);
+            emit_u8(e, 0x8B); emit_mem(e, JIT_EAX, TICKS_OFFSET); // mov eax, [state + ticks]
+            emit_u8(e, 0x89); emit_mem(e, JIT_EAX, tick_offset);  // mov [state + tick_offset], eax
+        } break;
+
+        case OP_ADD_I_VX: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0x66); emit_u8(e, 0x01);             // add word [state + I], ax
+            emit_mem(e, JIT_EAX, I_OFFSET);
+        } break;
+
+        case OP_LD_F_VX: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0x8D); emit_u8(e, 0x04); emit_u8(e, 0x80); // lea eax, [rax + rax*4]
+            emit_u8(e, 0x66); emit_u8(e, 0x89);             // mov word [state + I], ax
+            emit_mem(e, JIT_EAX, I_OFFSET);
+        } break;
+
+        case OP_LD_HF_VX: {
+            emit_load_byte(e, JIT_EAX, V_OFFSET(x));
+            emit_u8(e, 0x8D); emit_u8(e, 0x04); emit_u8(e, 0x80); // lea eax, [rax + rax*4]
+            emit_u8(e, 0x01); emit_u8(e, 0xC0);             // add eax, eax
+            emit_u8(e, 0x05); emit_u32(e, BIG_FONTS_ADDRESS); // add eax, BIG_FONTS_ADDRESS
+            emit_u8(e, 0x66); emit_u8(e, 0x89);             // mov word [state + I], ax
+            emit_mem(e, JIT_EAX, I_OFFSET);
+        } break;
+
+        case OP_LD_VX_I: {
+            emit_u8(e, 0x0F); emit_u8(e, 0xB7);             // movzx edx, word [state + I]
+            emit_mem(e, JIT_EDX, I_OFFSET);
+            for (int i = 0; i <= x; i++) {
+                emit_u8(e, 0x8D); emit_u8(e, 0x42); emit_u8(e, (u8)i); // lea eax, [rdx + i]
+                emit_u8(e, 0x25); emit_u32(e, MAX_MEMORY_SIZE - 1); // and eax, 0xFFF
+                emit_u8(e, 0x0F); emit_u8(e, 0xB6);         // movzx eax, byte [state + rax + memory]
+                emit_mem_indexed(e, JIT_EAX, JIT_EAX, 0, MEMORY_OFFSET);
+                emit_store_al(e, V_OFFSET(i));
+            }
+        } break;
+
+        case OP_NOP: {
+        } break;
+    }
+
+    return 1;
+}
+
+static void jit_compile(Chip8_jit *jit, Chip8_state *state, u16 start)
+{
+    Jit_block *block = &jit->blocks[start];
+
+    if (jit->used + JIT_MAX_BLOCK_INSTRUCTIONS*JIT_MAX_INSTRUCTION_BYTES > JIT_BUFFER_SIZE) {
+        jit_flush(jit);
+    }
+
+    Jit_emitter e = { jit->buffer + jit->used };
+
+    emit_u8(&e, 0x41); emit_u8(&e, 0x89); emit_u8(&e, (u8)(0xC0 | (JIT_BUDGET << 3))); // mov r8d, budget
+    emit_u8(&e, 0x45); emit_u8(&e, 0x31); emit_u8(&e, 0xC9);                          // xor r9d, r9d
+
+    Jit_block_context context = { start, e.at };
+
+    u16 address = start;
+    u16 length = 0;
+    int ends_block = 0;
+    int idle_body = 1;
+    int loops = 0;
+    while (!ends_block && length < JIT_MAX_BLOCK_INSTRUCTIONS && address + 1 < MAX_MEMORY_SIZE) {
+        Decoded_instruction *inst = &state->decoded[address];
+        if (inst->op == OP_NONE) {
+            decode_instruction(fetch_opcode(state, address), inst);
+        }
+
+        if (!jit_emit_instruction(&e, &context, inst, address, length, &ends_block)) {
+            break;
+        }
+
+        if (inst->op == OP_JP && inst->nnn == start) {
+            loops = 1;
+        } else if (!is_idle_op(inst->op)) {
+            idle_body = 0;
+        }
+
+        jit->code_map[address] = 1;
+        jit->code_map[address + 1] = 1;
+        address += 2;
+        length++;
+    }
+
+    // Mark the first instruction even when it isn't compiled, so that the block gets
+    // looked at again if that code is overwritten.
+    jit->code_map[start] = 1;
+    jit->code_map[MEMORY_ADDRESS(start + 1)] = 1;
+
+    if (length == 0) {
+        block->status = JIT_BLOCK_INTERPRET;
+        return;
+    }
+
+    if (!ends_block) {
+        emit_exit(&e, address, length);
+    }
+
+    block->code = jit->buffer + jit->used;
+    block->status = JIT_BLOCK_COMPILED;
+    block->idle = (u8)(loops && idle_body && length - 1 <= IDLE_MAX_BODY);
+    block->length = length;
+
+    jit->used = (u32)(e.at - jit->buffer);
+}
+
+/*
+Runs one pass of a block that may be an idle loop, with left instructions to run, and
+when it comes back to its start leaving the registers as they were, skips the whole
+passes left, as run_idle_loop() does. Returns how many instructions were run or
+skipped, and adds those skipped to *skipped.
+*/
+static u32 jit_run_idle_block(Chip8_state *state, Jit_block *block, u32 left, u32 *skipped)
+{
+    u16 start = state->pc;
+    u8 V[16];
+    memcpy(V, state->V, sizeof(V));
+    u16 I = state->I;
+
+    // With a budget of one pass, the loop back to the start leaves the block.
+    Jit_block_fn code = (Jit_block_fn)block->code;
+    u32 executed = code(state, block->length);
+    if (executed != block->length || state->pc != start) {
+        return executed;
+    }
+
+    // A busy loop: the passes left run in the block.
+    if (memcmp(V, state->V, sizeof(V)) != 0 || I != state->I) {
+        return (left - executed >= block->length) ? executed + code(state, left - executed) : executed;
+    }
+
+    state->idle = 1;
+
+    u32 skip = (left - executed) / executed * executed;
+    *skipped += skip;
+
+    return executed + skip;
+}
+
+#endif
+
+/*
+Runs count instructions, the same as run_instructions(). Blocks that don't fit in
+what is left of count are interpreted one instruction at a time.
+Returns how many instructions were executed, not counting those skipped.
+*/
+static u32 jit_run(Chip8_jit *jit, Chip8_state *state, u32 count)
+{
+    u32 executed = 0; // Or skipped.
+    u32 skipped = 0;
+
+#ifdef CHIP8_JIT_SUPPORTED
+    if (!jit->buffer) {
+        return run_instructions(state, count);
+    }
+
+    while (executed < count) {
+        Decoded_instruction *inst = fetch_decoded(state);
+        if (inst->op == OP_JP) {
+            u32 ran = run_idle_loop(state, inst, count - executed, &skipped);
+            if (ran) {
+                executed += ran;
+                continue;
+            }
+        }
+
+        if (state->pc < MAX_MEMORY_SIZE) {
+            Jit_block *block = &jit->blocks[state->pc];
+            if (block->status == JIT_BLOCK_NONE) {
+                jit_compile(jit, state, state->pc);
+            }
+
+            if (block->status == JIT_BLOCK_COMPILED && block->length <= count - executed) {
+                if (block->idle) {
+                    executed += jit_run_idle_block(state, block, count - executed, &skipped);
+                } else {
+                    executed += ((Jit_block_fn)block->code)(state, count - executed);
+                }
+                continue;
+            }
+        }
+
+        u8 op = inst->op;
+        u8 x = inst->x;
+        u16 I = state->I;
+
+        emulate(state);
+        executed++;
+
+        if (stopped_on(state, op)) {
+            break;
+        }
+
+        if (op == OP_LD_B_VX) {
+            jit_invalidate(jit, I, 3);
+        } else if (op == OP_LD_I_VX) {
+            jit_invalidate(jit, I, x + 1);
+        }
+    }
+
+    return executed - skipped;
+#else
+    return run_instructions(state, count);
+#endif
+}
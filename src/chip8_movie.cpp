@@ -0,0 +1,181 @@
+/*
+Movies (see chip8_core.h).
+*/
+
+#define MOVIE_HEADER_SIZE       (36)
+#define MOVIE_MIN_EVENT_SIZE    (3)     /* A byte of cycles and two of keys */
+
+static void movie_put(u8 *at, u64 value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        at[i] = (u8)(value >> (8 * i));
+    }
+}
+
+static u64 movie_get(u8 *at, int size)
+{
+    u64 value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (u64)at[i] << (8 * i);
+    }
+
+    return value;
+}
+
+void start_movie(Chip8_movie *movie, Chip8_state *state, u32 seed, u32 cycles_per_frame)
+{
+    memset(movie, 0, sizeof(*movie));
+    movie->rom_hash = state->rom_hash;
+    movie->seed = seed;
+    movie->cycles_per_frame = cycles_per_frame;
+}
+
+void record_movie(Chip8_movie *movie, Chip8_state *state)
+{
+    u16 keys = state->keys;
+
+    // Nothing held until the first event.
+    u16 held = movie->count ? movie->events[movie->count - 1].keys : 0;
+    if (keys == held) {
+        return;
+    }
+
+    if (movie->count == movie->capacity) {
+        movie->capacity = movie->capacity ? movie->capacity * 2 : 256;
+        movie->events = (Movie_event *)realloc(movie->events, movie->capacity * sizeof(Movie_event));
+    }
+
+    movie->events[movie->count].cycle = state->cycles;
+    movie->events[movie->count].keys = keys;
+    movie->count++;
+}
+
+void play_movie(Chip8_movie *movie, Chip8_state *state)
+{
+    while (movie->next < movie->count && movie->events[movie->next].cycle <= state->cycles) {
+        movie->next++;
+    }
+
+    state->keys = movie->next ? movie->events[movie->next - 1].keys : 0;
+}
+
+int write_movie(Chip8_movie *movie, Chip8_state *state, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        return MOVIE_FILE_ERROR;
+    }
+
+    movie->length = state->cycles;
+
+    u8 header[MOVIE_HEADER_SIZE];
+    movie_put(header, MOVIE_MAGIC, 4);
+    movie_put(header + 4, MOVIE_VERSION, 4);
+    movie_put(header + 8, movie->rom_hash, 8);
+    movie_put(header + 16, movie->seed, 4);
+    movie_put(header + 20, movie->cycles_per_frame, 4);
+    movie_put(header + 24, movie->length, 8);
+    movie_put(header + 32, movie->count, 4);
+    int ok = (fwrite(header, sizeof(header), 1, file) == 1);
+
+    u64 cycle = 0;
+    for (u32 i = 0; i < movie->count && ok; i++) {
+        u8 event[12];
+        int size = 0;
+
+        u64 delta = movie->events[i].cycle - cycle;
+        cycle = movie->events[i].cycle;
+        do {
+            event[size++] = (u8)((delta & 0x7F) | ((delta > 0x7F) ? 0x80 : 0));
+            delta >>= 7;
+        } while (delta);
+
+        movie_put(event + size, movie->events[i].keys, 2);
+        size += 2;
+
+        ok = (fwrite(event, size, 1, file) == 1);
+    }
+
+    fclose(file);
+
+    return ok ? 0 : MOVIE_FILE_ERROR;
+}
+
+int read_movie(Chip8_movie *movie, const char *filename)
+{
+    memset(movie, 0, sizeof(*movie));
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return MOVIE_FILE_ERROR;
+    }
+
+    u8 header[MOVIE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        movie_get(header, 4) != MOVIE_MAGIC || movie_get(header + 4, 4) != MOVIE_VERSION) {
+        fclose(file);
+        return MOVIE_FILE_ERROR;
+    }
+
+    movie->rom_hash = movie_get(header + 8, 8);
+    movie->seed = (u32)movie_get(header + 16, 4);
+    movie->cycles_per_frame = (u32)movie_get(header + 20, 4);
+    movie->length = movie_get(header + 24, 8);
+    movie->count = (u32)movie_get(header + 32, 4);
+    movie->capacity = movie->count;
+
+    // The count comes from the file: no more events than the rest of it can hold.
+    long start = ftell(file);
+    long end = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+    if (start < 0 || end < start || fseek(file, start, SEEK_SET) != 0 ||
+        movie->count > (u64)(end - start) / MOVIE_MIN_EVENT_SIZE) {
+        fclose(file);
+        memset(movie, 0, sizeof(*movie));
+        return MOVIE_FILE_ERROR;
+    }
+
+    movie->events = (Movie_event *)malloc(((size_t)movie->count + 1) * sizeof(Movie_event));
+    if (!movie->events) {
+        fclose(file);
+        memset(movie, 0, sizeof(*movie));
+        return MOVIE_FILE_ERROR;
+    }
+
+    int ok = 1;
+    u64 cycle = 0;
+    for (u32 i = 0; i < movie->count; i++) {
+        u64 delta = 0;
+        int shift = 0;
+        int byte;
+        do {
+            byte = fgetc(file);
+            delta |= (u64)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte != EOF && (byte & 0x80) && shift < 64);
+
+        u8 keys[2];
+        ok = (byte != EOF) && !(byte & 0x80) && (fread(keys, sizeof(keys), 1, file) == 1);
+        if (!ok) {
+            break;
+        }
+
+        cycle += delta;
+        movie->events[i].cycle = cycle;
+        movie->events[i].keys = (u16)movie_get(keys, 2);
+    }
+
+    fclose(file);
+
+    if (!ok) {
+        free_movie(movie);
+        return MOVIE_FILE_ERROR;
+    }
+
+    return 0;
+}
+
+void free_movie(Chip8_movie *movie)
+{
+    free(movie->events);
+    memset(movie, 0, sizeof(*movie));
+}
@@ -0,0 +1,261 @@
+#ifndef CHIP8_PLATFORM_H
+#define CHIP8_PLATFORM_H
+
+/*
+The little of the OS the command line tools and the vector environment need on top of
+the core: threads, a spin lock, semaphores, an atomic counter, a monotonic clock, the
+CPU count, the peak memory use and directory listing.
+*/
+
+#include <stdio.h>
+#include "types.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef void (*Thread_proc)(void *data);
+
+struct Thread {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    Thread_proc proc;
+    void *data;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID parameter)
+{
+    Thread *thread = (Thread *)parameter;
+    thread->proc(thread->data);
+
+    return 0;
+}
+#else
+static void *thread_entry(void *parameter)
+{
+    Thread *thread = (Thread *)parameter;
+    thread->proc(thread->data);
+
+    return 0;
+}
+#endif
+
+// The Thread must stay alive until join_thread().
+static void start_thread(Thread *thread, Thread_proc proc, void *data)
+{
+    thread->proc = proc;
+    thread->data = data;
+#ifdef _WIN32
+    thread->handle = CreateThread(0, 0, thread_entry, thread, 0, 0);
+#else
+    pthread_create(&thread->handle, 0, thread_entry, thread);
+#endif
+}
+
+static void join_thread(Thread *thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, 0);
+#endif
+}
+
+static int get_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+#endif
+}
+
+// Seconds from an arbitrary starting point.
+static double get_seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#endif
+}
+
+// Largest resident set of the process so far, in KB.
+static u64 get_peak_rss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return (u64)counters.PeakWorkingSetSize / 1024;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (u64)usage.ru_maxrss; // KB on Linux.
+#endif
+}
+
+// Spin lock, for critical sections of a few instructions. 0 is unlocked.
+static void lock(volatile s32 *spin_lock)
+{
+#ifdef _WIN32
+    while (InterlockedExchange((volatile LONG *)spin_lock, 1) != 0) {
+        YieldProcessor();
+    }
+#else
+    while (__atomic_exchange_n(spin_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+#endif
+}
+
+static void unlock(volatile s32 *spin_lock)
+{
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG *)spin_lock, 0);
+#else
+    __atomic_store_n(spin_lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+// Returns *value + amount, adding it atomically.
+static s32 atomic_add(volatile s32 *value, s32 amount)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd((volatile LONG *)value, amount) + amount;
+#else
+    return __atomic_add_fetch(value, amount, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// Counting semaphore, for threads that wait for work without spinning.
+struct Semaphore {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    s32 count;
+#endif
+};
+
+static void init_semaphore(Semaphore *semaphore)
+{
+#ifdef _WIN32
+    semaphore->handle = CreateSemaphoreA(0, 0, 0x7FFFFFFF, 0);
+#else
+    pthread_mutex_init(&semaphore->mutex, 0);
+    pthread_cond_init(&semaphore->condition, 0);
+    semaphore->count = 0;
+#endif
+}
+
+static void free_semaphore(Semaphore *semaphore)
+{
+#ifdef _WIN32
+    CloseHandle(semaphore->handle);
+#else
+    pthread_cond_destroy(&semaphore->condition);
+    pthread_mutex_destroy(&semaphore->mutex);
+#endif
+}
+
+static void post_semaphore(Semaphore *semaphore, s32 count)
+{
+#ifdef _WIN32
+    ReleaseSemaphore(semaphore->handle, count, 0);
+#else
+    pthread_mutex_lock(&semaphore->mutex);
+    semaphore->count += count;
+    pthread_cond_broadcast(&semaphore->condition);
+    pthread_mutex_unlock(&semaphore->mutex);
+#endif
+}
+
+static void wait_semaphore(Semaphore *semaphore)
+{
+#ifdef _WIN32
+    WaitForSingleObject(semaphore->handle, INFINITE);
+#else
+    pthread_mutex_lock(&semaphore->mutex);
+    while (semaphore->count == 0) {
+        pthread_cond_wait(&semaphore->condition, &semaphore->mutex);
+    }
+    semaphore->count--;
+    pthread_mutex_unlock(&semaphore->mutex);
+#endif
+}
+
+typedef void (*File_proc)(const char *path, void *data);
+
+/*
+Calls proc for every regular file in the directory at path (not recursively).
+Returns 0 if path isn't a directory.
+*/
+static int list_directory(const char *path, File_proc proc, void *data)
+{
+    char file_path[1024];
+
+#ifdef _WIN32
+    char pattern[1024];
+    snprintf(pattern, sizeof(pattern), "%s\\*", path);
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA(pattern, &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    do {
+        if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            snprintf(file_path, sizeof(file_path), "%s\\%s", path, find_data.cFileName);
+            proc(file_path, data);
+        }
+    } while (FindNextFileA(find, &find_data));
+
+    FindClose(find);
+#else
+    DIR *directory = opendir(path);
+    if (!directory) {
+        return 0;
+    }
+
+    dirent *entry;
+    while ((entry = readdir(directory)) != 0) {
+        snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
+
+        struct stat info;
+        if (stat(file_path, &info) == 0 && S_ISREG(info.st_mode)) {
+            proc(file_path, data);
+        }
+    }
+
+    closedir(directory);
+#endif
+
+    return 1;
+}
+
+#endif
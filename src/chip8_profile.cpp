@@ -0,0 +1,179 @@
+/*
+Profile (see chip8_core.h).
+
+Compiled in with CHIP8_PROFILE only, so that other builds pay nothing for it. Ticks are
+read from the timestamp counter on x86, and from clock() elsewhere.
+*/
+
+#define PROFILE_HOT_PCS         32      /* PCs listed in the report */
+
+#ifdef CHIP8_PROFILE
+#ifdef CHIP8_X86
+#ifndef _MSC_VER
+#include <x86intrin.h>
+#endif
+static inline u64 read_ticks()
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+static inline u64 read_ticks()
+{
+    return (u64)clock();
+}
+#endif
+
+// Like run_instructions(), counting every instruction before it runs.
+static u32 run_profiled(Chip8_state *state, u32 count)
+{
+    Chip8_profile *profile = state->profile;
+    u64 start = read_ticks();
+
+    u32 i = 0;
+    while (i < count) {
+        u16 pc = MEMORY_ADDRESS(state->pc);
+        u8 op = fetch_decoded(state)->op;
+        profile->op_counts[op]++;
+        profile->pc_counts[pc]++;
+
+        if (op == OP_DRW) {
+            u64 drw_start = read_ticks();
+            emulate(state);
+            profile->drw_ticks += read_ticks() - drw_start;
+        } else {
+            emulate(state);
+        }
+        i++;
+
+        if (stopped_on(state, op)) {
+            break;
+        }
+    }
+
+    profile->ticks += read_ticks() - start;
+
+    return i;
+}
+
+// Indexed by Op_kind.
+static const char *profile_op_names[OP_COUNT] = {
+    "none", "00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+    "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7", "8xyE", "9xy0",
+    "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07", "Fx0A", "Fx15", "Fx18",
+    "Fx1E", "Fx29", "Fx33", "Fx55", "Fx65", "00Cn", "00FB", "00FC", "00FD", "00FE",
+    "00FF", "Fx30", "Fx75", "Fx85", "nop", "unknown",
+};
+
+struct Profile_entry {
+    u32 key; // Op_kind or PC.
+    u64 count;
+};
+
+// Most counted first.
+static int compare_profile_entries(const void *a, const void *b)
+{
+    Profile_entry *entry_a = (Profile_entry *)a;
+    Profile_entry *entry_b = (Profile_entry *)b;
+    if (entry_a->count != entry_b->count) {
+        return (entry_a->count > entry_b->count) ? -1 : 1;
+    }
+
+    return (entry_a->key < entry_b->key) ? -1 : 1;
+}
+
+// Fills entries with the non-zero counts, sorted, and returns how many there are.
+static int sort_profile_counts(Profile_entry *entries, u64 *counts, int size)
+{
+    int count = 0;
+    for (int i = 0; i < size; i++) {
+        if (counts[i]) {
+            entries[count].key = i;
+            entries[count].count = counts[i];
+            count++;
+        }
+    }
+
+    qsort(entries, count, sizeof(Profile_entry), compare_profile_entries);
+
+    return count;
+}
+
+static double profile_share(u64 part, u64 total)
+{
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+int write_profile(Chip8_state *state, const char *filename)
+{
+    Chip8_profile *profile = state->profile;
+    if (!profile) {
+        return PROFILE_ERROR;
+    }
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        return PROFILE_ERROR;
+    }
+
+    u64 instructions = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        instructions += profile->op_counts[op];
+    }
+
+    Profile_entry ops[OP_COUNT];
+    Profile_entry *pcs = (Profile_entry *)malloc(MAX_MEMORY_SIZE * sizeof(Profile_entry));
+    int op_count = sort_profile_counts(ops, profile->op_counts, OP_COUNT);
+    int pc_count = sort_profile_counts(pcs, profile->pc_counts, MAX_MEMORY_SIZE);
+
+    size_t length = strlen(filename);
+    if (length >= 5 && strcmp(filename + length - 5, ".json") == 0) {
+        fprintf(file, "{\n  \"instructions\": %llu,\n  \"ticks\": %llu,\n  \"drw_ticks\": %llu,\n",
+                (unsigned long long)instructions, (unsigned long long)profile->ticks,
+                (unsigned long long)profile->drw_ticks);
+
+        fprintf(file, "  \"ops\": [");
+        for (int i = 0; i < op_count; i++) {
+            fprintf(file, "%s\n    {\"op\": \"%s\", \"count\": %llu}", i ? "," : "",
+                    profile_op_names[ops[i].key], (unsigned long long)ops[i].count);
+        }
+
+        fprintf(file, "\n  ],\n  \"pcs\": [");
+        for (int i = 0; i < pc_count; i++) {
+            fprintf(file, "%s\n    {\"pc\": %u, \"opcode\": \"%04X\", \"count\": %llu}", i ? "," : "",
+                    pcs[i].key, fetch_opcode(state, (u16)pcs[i].key), (unsigned long long)pcs[i].count);
+        }
+
+        fprintf(file, "\n  ]\n}\n");
+    } else {
+        fprintf(file, "%llu instructions in %llu ticks, %.1f%% of them in Dxyn\n\n",
+                (unsigned long long)instructions, (unsigned long long)profile->ticks,
+                profile_share(profile->drw_ticks, profile->ticks));
+
+        fprintf(file, "Opcode  %14s  %7s\n", "Count", "Share");
+        for (int i = 0; i < op_count; i++) {
+            fprintf(file, "%-7s %14llu  %6.2f%%\n", profile_op_names[ops[i].key],
+                    (unsigned long long)ops[i].count, profile_share(ops[i].count, instructions));
+        }
+
+        fprintf(file, "\nPC      %14s  %7s  Opcode\n", "Count", "Share");
+        for (int i = 0; i < pc_count && i < PROFILE_HOT_PCS; i++) {
+            fprintf(file, "0x%03X   %14llu  %6.2f%%  %04X\n", pcs[i].key,
+                    (unsigned long long)pcs[i].count, profile_share(pcs[i].count, instructions),
+                    fetch_opcode(state, (u16)pcs[i].key));
+        }
+    }
+
+    free(pcs);
+
+    int error = ferror(file);
+    fclose(file);
+
+    return error ? PROFILE_ERROR : 0;
+}
+#else
+int write_profile(Chip8_state *state, const char *filename)
+{
+    return PROFILE_ERROR;
+}
+#endif
@@ -0,0 +1,224 @@
+/*
+Rewind buffer (see chip8_core.h).
+
+The latest pushed snapshot is kept whole. Every push before it is stored as the XOR of
+it and the snapshot that followed, run-length encoded: as little changes from one frame
+to the next, most of the XOR is zeros. Going back one frame XORs the newest delta into
+the latest snapshot.
+
+Encoded deltas are a list of records, each made of a u16 count of zero bytes to skip,
+a u16 count of literal bytes, and the literal bytes.
+
+They are laid out one after the other in a byte ring. A delta that doesn't fit before
+the end of the buffer goes at the start, and the ones it would overwrite are dropped,
+oldest first, since each delta is only reachable through the newer ones.
+*/
+
+#define REWIND_MIN_ZEROS        4       /* Zero bytes worth ending a literal run for */
+#define REWIND_MAX_RUN          (0xFFFF)
+#define REWIND_MAX_DELTA        (2 * sizeof(Chip8_snapshot)) /* Worst case of the encoding, with margin */
+
+struct Rewind_entry {
+    u32 offset; // In the byte ring.
+    u32 size;
+};
+
+static inline void rewind_write_u16(u8 *at, u32 value)
+{
+    at[0] = (u8)(value & 0xFF);
+    at[1] = (u8)(value >> 8);
+}
+
+static inline u32 rewind_read_u16(u8 *at)
+{
+    return at[0] | (u32)at[1] << 8;
+}
+
+// Encodes a XOR b into out and returns its size.
+static u32 rewind_encode(u8 *out, u8 *a, u8 *b, u32 size)
+{
+    u32 at = 0;
+    u32 i = 0;
+    while (i < size) {
+        u32 zeros = 0;
+        while (i + 8 <= size && zeros + 8 <= REWIND_MAX_RUN && memcmp(a + i, b + i, 8) == 0) {
+            i += 8;
+            zeros += 8;
+        }
+        while (i < size && zeros < REWIND_MAX_RUN && a[i] == b[i]) {
+            i++;
+            zeros++;
+        }
+
+        u32 literals = 0;
+        u8 *record = out + at;
+        at += 4;
+        while (i < size && literals < REWIND_MAX_RUN) {
+            u32 equal = 0;
+            while (equal < REWIND_MIN_ZEROS && i + equal < size && a[i + equal] == b[i + equal]) {
+                equal++;
+            }
+            if (equal == REWIND_MIN_ZEROS || i + equal == size) {
+                break;
+            }
+
+            out[at++] = a[i] ^ b[i];
+            i++;
+            literals++;
+        }
+
+        rewind_write_u16(record, zeros);
+        rewind_write_u16(record + 2, literals);
+    }
+
+    return at;
+}
+
+// XORs an encoded delta into data.
+static void rewind_apply(u8 *data, u8 *delta, u32 size)
+{
+    u32 i = 0;
+    for (u32 at = 0; at < size;) {
+        i += rewind_read_u16(delta + at);
+        u32 literals = rewind_read_u16(delta + at + 2);
+        at += 4;
+
+        for (u32 j = 0; j < literals; j++) {
+            data[i++] ^= delta[at++];
+        }
+    }
+}
+
+static void rewind_drop_oldest(Chip8_rewind *rewind)
+{
+    u32 offset = rewind->entries[rewind->first].offset;
+    rewind->first = (rewind->first + 1) % rewind->depth;
+    rewind->count--;
+
+    if (rewind->count == 0) {
+        rewind->head = 0;
+        rewind->wrapped = 0;
+    } else if (rewind->wrapped && rewind->entries[rewind->first].offset < offset) {
+        // Everything left is at the start of the ring.
+        rewind->wrapped = 0;
+    }
+}
+
+// Returns the offset of size free bytes in the ring, dropping old deltas to make room.
+static u32 rewind_allocate(Chip8_rewind *rewind, u32 size)
+{
+    if (rewind->count == rewind->depth) {
+        rewind_drop_oldest(rewind);
+    }
+
+    for (;;) {
+        if (rewind->count == 0) {
+            break;
+        }
+
+        u32 tail = rewind->entries[rewind->first].offset;
+        if (!rewind->wrapped) {
+            // Live deltas in [tail, head).
+            if (rewind->head + size <= rewind->buffer_size) {
+                break;
+            }
+
+            rewind->wrap_end = rewind->head;
+            rewind->head = 0;
+            rewind->wrapped = 1;
+        } else {
+            // Live deltas in [tail, wrap_end) and [0, head).
+            if (rewind->head + size <= tail) {
+                break;
+            }
+
+            rewind_drop_oldest(rewind);
+        }
+    }
+
+    u32 offset = rewind->head;
+    rewind->head += size;
+
+    return offset;
+}
+
+void init_rewind(Chip8_rewind *rewind, u32 depth, u32 buffer_size)
+{
+    memset(rewind, 0, sizeof(*rewind));
+    rewind->depth = depth;
+    rewind->entries = (Rewind_entry *)calloc(depth, sizeof(Rewind_entry));
+
+    // Room for at least one delta whatever it holds.
+    rewind->buffer_size = (buffer_size > REWIND_MAX_DELTA) ? buffer_size : (u32)REWIND_MAX_DELTA;
+    rewind->buffer = (u8 *)malloc(rewind->buffer_size);
+
+    rewind->snapshots = (Chip8_snapshot *)calloc(2, sizeof(Chip8_snapshot));
+    rewind->scratch = (u8 *)malloc(REWIND_MAX_DELTA);
+}
+
+void free_rewind(Chip8_rewind *rewind)
+{
+    free(rewind->entries);
+    free(rewind->buffer);
+    free(rewind->snapshots);
+    free(rewind->scratch);
+    memset(rewind, 0, sizeof(*rewind));
+}
+
+void push_rewind(Chip8_rewind *rewind, Chip8_state *state)
+{
+    Chip8_snapshot *latest = &rewind->snapshots[rewind->latest];
+    Chip8_snapshot *next = &rewind->snapshots[rewind->latest ^ 1];
+    save_chip8(state, next);
+
+    if (rewind->has_latest && rewind->depth > 0) {
+        u32 size = rewind_encode(rewind->scratch, (u8 *)latest, (u8 *)next, sizeof(Chip8_snapshot));
+        u32 offset = rewind_allocate(rewind, size);
+        memcpy(rewind->buffer + offset, rewind->scratch, size);
+
+        Rewind_entry *entry = &rewind->entries[(rewind->first + rewind->count) % rewind->depth];
+        entry->offset = offset;
+        entry->size = size;
+        rewind->count++;
+    }
+
+    rewind->latest ^= 1;
+    rewind->has_latest = 1;
+}
+
+int pop_rewind(Chip8_rewind *rewind, Chip8_state *state)
+{
+    if (rewind->count == 0) {
+        return 0;
+    }
+
+    rewind->count--;
+    Rewind_entry *entry = &rewind->entries[(rewind->first + rewind->count) % rewind->depth];
+
+    Chip8_snapshot *latest = &rewind->snapshots[rewind->latest];
+    rewind_apply((u8 *)latest, rewind->buffer + entry->offset, entry->size);
+
+    rewind->head = entry->offset;
+    if (rewind->count == 0) {
+        rewind->head = 0;
+        rewind->wrapped = 0;
+    } else if (rewind->wrapped && entry->offset == 0) {
+        // Nothing left at the start of the ring.
+        rewind->head = rewind->wrap_end;
+        rewind->wrapped = 0;
+    }
+
+    restore_chip8(state, latest);
+
+    return 1;
+}
+
+u32 get_rewind_bytes(Chip8_rewind *rewind)
+{
+    u32 bytes = 0;
+    for (u32 i = 0; i < rewind->count; i++) {
+        bytes += rewind->entries[(rewind->first + i) % rewind->depth].size;
+    }
+
+    return bytes;
+}
@@ -0,0 +1,276 @@
+/*
+Vectorized environment (see chip8_vec_env.h).
+
+The calling thread and thread_count - 1 workers step the envs, taking them a batch at a
+time from a shared counter. Workers sleep on a semaphore between steps.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_vec_env.h"
+#include "chip8_platform.h"
+
+#define VEC_ENV_BATCH           (4)     /* Envs taken at a time by a thread */
+
+// What the io callbacks of an env need.
+struct Vec_env_slot {
+    Vec_env *env;
+    int index;
+};
+
+struct Vec_env_pool {
+    Vec_env_slot *slots;
+
+    Thread *threads;
+    int thread_count; // Workers, not counting the calling thread.
+
+    Semaphore start;
+    Semaphore finished;
+
+    const u16 *actions; // Of the running step.
+    volatile s32 next_env;
+    int quit;
+};
+
+// A 64x32 screen is scaled up by 2, so that the observation is the same size in both resolutions.
+static void draw_screen(void *user_data, Chip8_state *state)
+{
+    Vec_env_slot *slot = (Vec_env_slot *)user_data;
+    u8 *observation = slot->env->observations + (size_t)slot->index * SCREEN_SIZE;
+    int scale = state->hires ? 1 : 2;
+    for (int y = 0; y < get_screen_height(state); y++) {
+        if (!(state->dirty_rows & ((u64)1 << y))) {
+            continue;
+        }
+
+        u8 *row = observation + y * scale * SCREEN_WIDTH;
+        for (int x = 0; x < get_screen_width(state); x++) {
+            memset(row + x * scale, get_pixel(state, x, y), scale);
+        }
+        if (scale == 2) {
+            memcpy(row + SCREEN_WIDTH, row, SCREEN_WIDTH);
+        }
+    }
+}
+
+static u16 read_probe(Chip8_state *state, Vec_env_probe *probe)
+{
+    u16 value = state->memory[MEMORY_ADDRESS(probe->address)];
+    if (probe->size == 2) {
+        value = (u16)(value << 8 | state->memory[MEMORY_ADDRESS(probe->address + 1)]);
+    }
+
+    return value;
+}
+
+static void reset_env(Vec_env *env, int index)
+{
+    Chip8_state *state = &env->states[index];
+
+    // The PRNG carries on, so that episodes differ.
+    u32 random_state = state->random_state;
+    load_chip8(state, env->rom, env->rom_size, &env->io[index]);
+    state->random_state = random_state;
+
+    env->episode_frames[index] = 0;
+    env->dones[index] = 0;
+
+    u32 *values = env->probe_values + (size_t)index * env->config.probe_count;
+    for (int p = 0; p < env->config.probe_count; p++) {
+        values[p] = read_probe(state, &env->config.probes[p]);
+    }
+}
+
+static void step_env(Vec_env *env, int index, u16 action)
+{
+    Vec_env_config *config = &env->config;
+    Chip8_state *state = &env->states[index];
+
+    if (env->dones[index]) {
+        reset_env(env, index);
+    }
+
+    state->keys = action;
+
+    for (u32 frame = 0; frame < config->frames_per_step && !state->error; frame++) {
+        run_chip8(state, config->cycles_per_frame);
+        end_chip8_frame(state);
+        env->episode_frames[index]++;
+    }
+
+    float reward = 0;
+    u8 done = (state->error != 0) ||
+              (config->max_episode_frames && env->episode_frames[index] >= config->max_episode_frames);
+
+    u32 *values = env->probe_values + (size_t)index * config->probe_count;
+    for (int p = 0; p < config->probe_count; p++) {
+        Vec_env_probe *probe = &config->probes[p];
+        u16 value = read_probe(state, probe);
+
+        switch (probe->kind) {
+            case PROBE_REWARD: {
+                reward += probe->scale * (float)((s32)value - (s32)values[p]);
+            } break;
+            case PROBE_DONE: {
+                if (value == probe->done_value) {
+                    done = 1;
+                }
+            } break;
+        }
+
+        values[p] = value;
+    }
+
+    env->rewards[index] = reward;
+    env->dones[index] = done;
+}
+
+// Steps batches of envs until none is left.
+static void step_envs(Vec_env *env)
+{
+    Vec_env_pool *pool = env->pool;
+
+    s32 first;
+    while ((first = atomic_add(&pool->next_env, VEC_ENV_BATCH) - VEC_ENV_BATCH) < env->config.env_count) {
+        s32 last = first + VEC_ENV_BATCH;
+        if (last > env->config.env_count) {
+            last = env->config.env_count;
+        }
+
+        for (s32 i = first; i < last; i++) {
+            step_env(env, i, pool->actions[i]);
+        }
+    }
+}
+
+static void worker_proc(void *data)
+{
+    Vec_env *env = (Vec_env *)data;
+    Vec_env_pool *pool = env->pool;
+
+    for (;;) {
+        wait_semaphore(&pool->start);
+        if (pool->quit) {
+            return;
+        }
+
+        step_envs(env);
+        post_semaphore(&pool->finished, 1);
+    }
+}
+
+int init_vec_env(Vec_env *env, Vec_env_config *config)
+{
+    memset(env, 0, sizeof(*env));
+    env->config = *config;
+    config = &env->config;
+    if (config->frames_per_step == 0) {
+        config->frames_per_step = 1;
+    }
+    if (config->cycles_per_frame == 0) {
+        config->cycles_per_frame = VEC_ENV_DEFAULT_CYCLES_PER_FRAME;
+    }
+    if (config->thread_count <= 0) {
+        config->thread_count = get_cpu_count();
+    }
+
+    FILE *rom = fopen(config->rom, "rb");
+    if (!rom) {
+        return ROM_DOES_NOT_EXISTS;
+    }
+
+    env->rom = (u8 *)malloc(MAX_MEMORY_SIZE - START_MEMORY);
+    env->rom_size = (u32)fread(env->rom, 1, MAX_MEMORY_SIZE - START_MEMORY, rom);
+    fclose(rom);
+
+    int count = config->env_count;
+    env->states = (Chip8_state *)calloc(count, sizeof(Chip8_state));
+    env->io = (Chip8_io *)calloc(count, sizeof(Chip8_io));
+    env->observations = (u8 *)calloc((size_t)count * SCREEN_SIZE, 1);
+    env->rewards = (float *)calloc(count, sizeof(float));
+    env->dones = (u8 *)calloc(count, 1);
+    env->episode_frames = (u32 *)calloc(count, sizeof(u32));
+    env->probe_values = (u32 *)calloc((size_t)count * config->probe_count + 1, sizeof(u32));
+
+    Vec_env_pool *pool = (Vec_env_pool *)calloc(1, sizeof(Vec_env_pool));
+    env->pool = pool;
+    pool->slots = (Vec_env_slot *)calloc(count, sizeof(Vec_env_slot));
+
+    for (int i = 0; i < count; i++) {
+        pool->slots[i].env = env;
+        pool->slots[i].index = i;
+
+        env->io[i].user_data = &pool->slots[i];
+        env->io[i].draw_screen = draw_screen;
+
+        seed_chip8(&env->states[i], config->seed + i);
+        reset_env(env, i);
+    }
+
+    init_semaphore(&pool->start);
+    init_semaphore(&pool->finished);
+    pool->thread_count = config->thread_count - 1;
+    pool->threads = (Thread *)calloc(pool->thread_count + 1, sizeof(Thread));
+    for (int t = 0; t < pool->thread_count; t++) {
+        start_thread(&pool->threads[t], worker_proc, env);
+    }
+
+    return 0;
+}
+
+void free_vec_env(Vec_env *env)
+{
+    Vec_env_pool *pool = env->pool;
+    if (pool) {
+        pool->quit = 1;
+        post_semaphore(&pool->start, pool->thread_count);
+        for (int t = 0; t < pool->thread_count; t++) {
+            join_thread(&pool->threads[t]);
+        }
+
+        free_semaphore(&pool->start);
+        free_semaphore(&pool->finished);
+        free(pool->threads);
+        free(pool->slots);
+        free(pool);
+    }
+
+    if (env->states) {
+        for (int i = 0; i < env->config.env_count; i++) {
+            free_chip8(&env->states[i]);
+        }
+    }
+
+    free(env->states);
+    free(env->io);
+    free(env->observations);
+    free(env->rewards);
+    free(env->dones);
+    free(env->episode_frames);
+    free(env->probe_values);
+    free(env->rom);
+    memset(env, 0, sizeof(*env));
+}
+
+void reset_vec_env(Vec_env *env)
+{
+    for (int i = 0; i < env->config.env_count; i++) {
+        reset_env(env, i);
+    }
+}
+
+void step_vec_env(Vec_env *env, const u16 *actions)
+{
+    Vec_env_pool *pool = env->pool;
+    pool->actions = actions;
+    pool->next_env = 0;
+
+    // The semaphores order these writes before the workers' reads, and theirs before ours.
+    post_semaphore(&pool->start, pool->thread_count);
+    step_envs(env);
+    for (int t = 0; t < pool->thread_count; t++) {
+        wait_semaphore(&pool->finished);
+    }
+}
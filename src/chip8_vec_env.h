@@ -0,0 +1,90 @@
+#ifndef CHIP8_VEC_ENV_H
+#define CHIP8_VEC_ENV_H
+
+/*
+Vectorized environment for reinforcement learning, Gym style: env_count instances of a
+ROM, all advanced by one step_vec_env() call on a pool of threads that lives as long as
+the environment.
+
+The results of a step are left in buffers allocated once by init_vec_env(), env i at
+index i, so a step allocates and copies nothing for the caller:
+- observations: the screens, SCREEN_SIZE bytes per env, 1 for a lit pixel, row by row.
+  A 64x32 screen is scaled up by 2 to SCREEN_WIDTH x SCREEN_HEIGHT. Only the rows that
+  changed are rewritten.
+- rewards: the sum over the reward probes of how much their value grew, times their scale.
+- dones: non-zero when the episode ended, on a done probe, an unknown opcode or
+  max_episode_frames. That env starts a new episode at its next step.
+*/
+
+#include "chip8_core.h"
+
+#define VEC_ENV_DEFAULT_CYCLES_PER_FRAME    (10)    /* 600 instructions per second */
+
+enum Vec_env_probe_kind {
+    PROBE_REWARD,   // Rewards scale per unit the value grows.
+    PROBE_DONE,     // Ends the episode when the value equals done_value.
+};
+
+// Value in the memory of every env, read at the end of each step.
+struct Vec_env_probe {
+    u8 kind; // Vec_env_probe_kind
+    u16 address;
+    u8 size; // 1 or 2 bytes, big-endian.
+
+    float scale; // PROBE_REWARD
+    u16 done_value; // PROBE_DONE
+};
+
+struct Vec_env_config {
+    const char *rom;
+    int env_count;
+    int thread_count; // 0 for one per CPU.
+
+    u32 frames_per_step; // Frames each action is held for, at least 1.
+    u32 cycles_per_frame; // 0 for VEC_ENV_DEFAULT_CYCLES_PER_FRAME.
+    u32 max_episode_frames; // 0 for no limit.
+
+    u32 seed; // Env i seeds its PRNG with seed + i.
+
+    Vec_env_probe *probes; // Must outlive the environment.
+    int probe_count;
+};
+
+struct Vec_env_pool;
+
+struct Vec_env {
+    Vec_env_config config;
+
+    Chip8_state *states;
+    Chip8_io *io;
+
+    // Results of the last step.
+    u8 *observations;
+    float *rewards;
+    u8 *dones;
+
+    u32 *episode_frames;
+    u32 *probe_values; // At the end of the last step, probe_count per env.
+
+    u8 *rom;
+    u32 rom_size;
+
+    Vec_env_pool *pool;
+};
+
+// Loads the ROM and starts the threads. Returns 0 or ROM_DOES_NOT_EXISTS.
+int init_vec_env(Vec_env *env, Vec_env_config *config);
+
+// Stops the threads and releases everything.
+void free_vec_env(Vec_env *env);
+
+// Starts a new episode in every env.
+void reset_vec_env(Vec_env *env);
+
+/*
+Runs frames_per_step frames on every env, env i holding down the keys in actions[i]
+(bit k for key k), and leaves the results in observations, rewards and dones.
+*/
+void step_vec_env(Vec_env *env, const u16 *actions);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+Vector environment test, on the determinism the environment promises.
+
+First, a Vec_env without probes or episode limit is stepped over a ROM, and after every
+step each env is checked against a plain Chip8_state run on its own with the same seed
+and keys: the hash of the machine and the observation, with no reward and no done. Once
+reset, every env must hash the same as a freshly loaded ROM.
+
+Then two Vec_envs with the same seed and config, one on a single thread and the other
+on several, go through episodes that end on a done probe or on max_episode_frames and
+start again, with a reset halfway: after every step, their envs must agree on the hash,
+the observation, the reward and the done flag.
+
+Usage: vec_env_test <rom>
+
+The probes read the score of BRIX (BCD at 0x314), ending an episode when its last digit
+is 3, but any ROM runs the same checks.
+Prints the first mismatch and exits with TEST_FAILED, or exits with 0.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/chip8_vec_env.h"
+
+#define USAGE_ERROR             1
+#define TEST_FAILED             11
+
+#define ENV_COUNT               (10)    /* Not a multiple of the envs a thread takes at a time */
+#define THREAD_COUNT            (3)
+#define STEP_COUNT              (400)
+#define FRAMES_PER_STEP         (4)
+#define MAX_EPISODE_FRAMES      (602)   /* Not a multiple of the frames per step */
+#define SEED                    (42)
+
+static Vec_env_probe probes[] = {
+    { PROBE_REWARD, 0x315, 2, 0.5f, 0 },
+    { PROBE_DONE, 0x316, 1, 0, 3 },
+};
+#define PROBE_COUNT             ((int)(sizeof(probes) / sizeof(probes[0])))
+
+static int failures;
+
+static void check(int ok, const char *part, int step, int index, const char *what)
+{
+    if (!ok && failures++ == 0) {
+        fprintf(stderr, "%s, step %d, env %d: %s differs\n", part, step, index, what);
+    }
+}
+
+// Each env holds a key, or none, for a few steps.
+static void next_actions(u16 *actions, int step, u32 *random_state)
+{
+    for (int i = 0; i < ENV_COUNT; i++) {
+        if ((step + i) % 8 == 0) {
+            *random_state ^= *random_state << 13;
+            *random_state ^= *random_state >> 17;
+            *random_state ^= *random_state << 5;
+            u32 key = *random_state % (KEY_NUMBER + 1);
+            actions[i] = (key < KEY_NUMBER) ? (u16)(1 << key) : 0;
+        }
+    }
+}
+
+// The whole screen of state, as the observation should have it.
+static int matches_observation(Chip8_state *state, u8 *observation)
+{
+    int scale = state->hires ? 1 : 2;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            if (observation[y * SCREEN_WIDTH + x] != get_pixel(state, x / scale, y / scale)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static void init_env(Vec_env *env, Vec_env_config *config)
+{
+    if (init_vec_env(env, config)) {
+        fprintf(stderr, "Can't load %s\n", config->rom);
+
+        exit(USAGE_ERROR);
+    }
+}
+
+// Every env against an instance of its own.
+static void test_single_instances(const char *rom)
+{
+    Vec_env_config config = {};
+    config.rom = rom;
+    config.env_count = ENV_COUNT;
+    config.thread_count = THREAD_COUNT;
+    config.frames_per_step = FRAMES_PER_STEP;
+    config.seed = SEED;
+
+    Vec_env env;
+    init_env(&env, &config);
+
+    Chip8_state *states = (Chip8_state *)calloc(ENV_COUNT, sizeof(Chip8_state));
+    for (int i = 0; i < ENV_COUNT; i++) {
+        init_chip8(&states[i], rom, 0);
+        seed_chip8(&states[i], SEED + i);
+    }
+
+    u16 actions[ENV_COUNT];
+    u32 random_state = SEED;
+    for (int step = 0; step < STEP_COUNT && !failures; step++) {
+        next_actions(actions, step, &random_state);
+        step_vec_env(&env, actions);
+
+        for (int i = 0; i < ENV_COUNT; i++) {
+            Chip8_state *state = &states[i];
+            state->keys = actions[i];
+            for (int frame = 0; frame < FRAMES_PER_STEP; frame++) {
+                run_chip8(state, VEC_ENV_DEFAULT_CYCLES_PER_FRAME);
+                end_chip8_frame(state);
+            }
+
+            u8 *observation = env.observations + (size_t)i * SCREEN_SIZE;
+            check(hash_chip8(&env.states[i]) == hash_chip8(state), "Single", step, i, "state");
+            check(matches_observation(state, observation), "Single", step, i, "observation");
+            check(env.rewards[i] == 0, "Single", step, i, "reward");
+            check(env.dones[i] == 0, "Single", step, i, "done");
+        }
+    }
+
+    // A new episode starts from the ROM as loaded.
+    Chip8_state loaded = {};
+    init_chip8(&loaded, rom, 0);
+    reset_vec_env(&env);
+    for (int i = 0; i < ENV_COUNT; i++) {
+        check(hash_chip8(&env.states[i]) == hash_chip8(&loaded), "Single", STEP_COUNT, i, "reset state");
+    }
+
+    free_chip8(&loaded);
+    for (int i = 0; i < ENV_COUNT; i++) {
+        free_chip8(&states[i]);
+    }
+    free(states);
+    free_vec_env(&env);
+}
+
+// One thread against several, through episodes. Returns the episodes ended.
+static int test_thread_counts(const char *rom)
+{
+    Vec_env_config config = {};
+    config.rom = rom;
+    config.env_count = ENV_COUNT;
+    config.frames_per_step = FRAMES_PER_STEP;
+    config.max_episode_frames = MAX_EPISODE_FRAMES;
+    config.seed = SEED;
+    config.probes = probes;
+    config.probe_count = PROBE_COUNT;
+
+    Vec_env single;
+    config.thread_count = 1;
+    init_env(&single, &config);
+
+    Vec_env pooled;
+    config.thread_count = THREAD_COUNT;
+    init_env(&pooled, &config);
+
+    u16 actions[ENV_COUNT];
+    u32 random_state = SEED;
+    int episodes = 0;
+    for (int step = 0; step < STEP_COUNT && !failures; step++) {
+        if (step == STEP_COUNT / 2) {
+            reset_vec_env(&single);
+            reset_vec_env(&pooled);
+        }
+
+        next_actions(actions, step, &random_state);
+        step_vec_env(&single, actions);
+        step_vec_env(&pooled, actions);
+
+        for (int i = 0; i < ENV_COUNT; i++) {
+            u8 *observation = single.observations + (size_t)i * SCREEN_SIZE;
+            u8 *pooled_observation = pooled.observations + (size_t)i * SCREEN_SIZE;
+            check(hash_chip8(&single.states[i]) == hash_chip8(&pooled.states[i]), "Threads", step, i, "state");
+            check(memcmp(observation, pooled_observation, SCREEN_SIZE) == 0, "Threads", step, i, "observation");
+            check(single.rewards[i] == pooled.rewards[i], "Threads", step, i, "reward");
+            check(single.dones[i] == pooled.dones[i], "Threads", step, i, "done");
+
+            episodes += single.dones[i];
+        }
+    }
+
+    free_vec_env(&single);
+    free_vec_env(&pooled);
+
+    return episodes;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <rom>\n", argv[0]);
+
+        exit(USAGE_ERROR);
+    }
+
+    test_single_instances(argv[1]);
+    int episodes = test_thread_counts(argv[1]);
+
+    printf("%d envs, %d steps: %d episodes ended, %s\n",
+           ENV_COUNT, STEP_COUNT, episodes, failures ? "FAILED" : "ok");
+
+    return failures ? TEST_FAILED : 0;
+}